@@ -0,0 +1,232 @@
+/* Helpers shared by the benchmarks. Each benchmark starts ./server with its
+   own settings, drives it through sockets like the clients do and prints
+   what it measured. Run them from the top directory with "make bench" */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_CONF "/tmp/chat-bench.conf"  /* Settings written for the server */
+#define BENCH_BUFFER 65536                 /* Bytes read at once from the server */
+
+/* Connection to the server, the messages it sends end with a '\0' */
+typedef struct {
+  int fd;
+  char buffer[BENCH_BUFFER];
+  size_t start;                 /* Where the next message starts in buffer */
+  size_t filled;                /* Bytes received in buffer */
+} bench_conn;
+
+static int bench_port;          /* Port of the server started */
+static pid_t bench_pid;         /* Process of the server started */
+
+/* Seconds on the monotonic clock */
+static inline double bench_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print a failure of the benchmark and leave, stopping the server */
+static inline void bench_fail(const char *what){
+  perror(what);
+  if (bench_pid > 0){
+    kill(bench_pid, SIGKILL);
+  }
+  exit(1);
+}
+
+/* Connect to the TCP port of the server, NULL if it refuses */
+static inline bench_conn *bench_connect(){
+  struct sockaddr_in addr;
+  bench_conn *conn;
+  int fd, one = 1;
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(bench_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))){
+    close(fd);
+    return NULL;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  conn = calloc(1, sizeof(bench_conn));
+  conn->fd = fd;
+  return conn;
+}
+
+/* Connect to the Unix socket of the server at path, NULL if it refuses */
+static inline bench_conn *bench_connect_unix(const char *path){
+  struct sockaddr_un addr;
+  bench_conn *conn;
+  int fd;
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))){
+    close(fd);
+    return NULL;
+  }
+  conn = calloc(1, sizeof(bench_conn));
+  conn->fd = fd;
+  return conn;
+}
+
+static inline void bench_close(bench_conn *conn){
+  close(conn->fd);
+  free(conn);
+}
+
+/* Send the whole of a formatted line */
+static inline void bench_send(bench_conn *conn, const char *format, ...){
+  char line[BENCH_BUFFER];
+  va_list args;
+  int length, sent, n;
+  va_start(args, format);
+  length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  for (sent = 0; sent < length; sent += n){
+    if ((n = send(conn->fd, line + sent, length - sent, MSG_NOSIGNAL)) < 0){
+      if (errno == EINTR){
+	n = 0;
+	continue;
+      }
+      bench_fail("send");
+    }
+  }
+}
+
+/* Return the next message of the server, NULL if none came within timeout
+   milliseconds or the connection closed. Valid until the next call */
+static inline char *bench_next(bench_conn *conn, int timeout){
+  struct pollfd pfd = { conn->fd, POLLIN, 0 };
+  char *message, *end;
+  ssize_t n;
+  for (;;){
+    message = conn->buffer + conn->start;
+    if ((end = memchr(message, '\0', conn->filled - conn->start))){
+      conn->start = end + 1 - conn->buffer;
+      return message;
+    }
+    /* Keep the start of the message, at the front of the buffer */
+    memmove(conn->buffer, message, conn->filled - conn->start);
+    conn->filled -= conn->start;
+    conn->start = 0;
+    if (conn->filled == sizeof(conn->buffer)){
+      conn->filled = 0;
+    }
+    if (poll(&pfd, 1, timeout) <= 0 ||
+	(n = recv(conn->fd, conn->buffer + conn->filled, sizeof(conn->buffer) - conn->filled, 0)) <= 0){
+      return NULL;
+    }
+    conn->filled += n;
+  }
+}
+
+/* Wait for a message of the server holding text, return it or NULL */
+static inline char *bench_expect(bench_conn *conn, const char *text, int timeout){
+  char *message;
+  while ((message = bench_next(conn, timeout))){
+    if (strstr(message, text)){
+      return message;
+    }
+  }
+  return NULL;
+}
+
+/* Start ./server on port with settings, "<key> <value>" lines, and wait
+   until it accepts connections. attach, if not NULL, is called with the
+   process of the server before it runs, e.g. to open counters on it */
+static inline void bench_server(int port, const char *settings, void (*attach)(pid_t)){
+  FILE *conf;
+  bench_conn *probe;
+  int go[2], null, i;
+  char c = 0;
+  if (!(conf = fopen(BENCH_CONF, "w"))){
+    bench_fail(BENCH_CONF);
+  }
+  fprintf(conf, "port %d\n%s", port, settings);
+  fclose(conf);
+  bench_port = port;
+  if (pipe(go)){
+    bench_fail("pipe");
+  }
+  if (!(bench_pid = fork())){
+    /* Wait for attach, the server is quiet */
+    close(go[1]);
+    if (read(go[0], &c, 1) != 1){
+      _exit(1);
+    }
+    null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execl("./server", "./server", BENCH_CONF, (char *)NULL);
+    _exit(127);
+  }
+  if (bench_pid < 0){
+    bench_fail("fork");
+  }
+  close(go[0]);
+  if (attach){
+    attach(bench_pid);
+  }
+  if (write(go[1], &c, 1) != 1){
+    bench_fail("write");
+  }
+  close(go[1]);
+  for (i = 0; i < 200; i++){
+    if ((probe = bench_connect())){
+      bench_close(probe);
+      return;
+    }
+    usleep(10000);
+  }
+  bench_fail("server didn't start");
+}
+
+/* Stop the server started, return its exit status */
+static inline int bench_stop(){
+  int status = 0;
+  kill(bench_pid, SIGINT);
+  waitpid(bench_pid, &status, 0);
+  bench_pid = 0;
+  return status;
+}
+
+static inline int bench_compare(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Return the q quantile (0 to 1) of the count values, sorting them */
+static inline double bench_quantile(double *values, int count, double q){
+  int i;
+  if (!count){
+    return 0;
+  }
+  qsort(values, count, sizeof(double), bench_compare);
+  i = (int)(q * (count - 1) + 0.5);
+  return values[i];
+}
@@ -0,0 +1,72 @@
+/* Connections per second the server accepts in a storm. STORMERS threads
+   connect, wait for the first message of the server and hang up, again and
+   again for DURATION seconds. The greeting and the refusals (server full,
+   out of fds) are counted apart: both prove the connection was handled */
+
+#include "bench.h"
+
+#define PORT 5603
+#define STORMERS 16
+#define DURATION 3
+
+static volatile int running = 1;
+static long admitted[STORMERS]; /* Connections greeted, one counter per thread */
+static long refused[STORMERS];  /* Connections refused by the server */
+static long failed[STORMERS];   /* Connections that got no answer */
+
+void *storm_loop(void *arg){
+  long n = (long)arg;
+  struct linger reset = { 1, 0 };
+  bench_conn *conn;
+  char *message;
+  while (running){
+    if (!(conn = bench_connect())){
+      failed[n]++;
+      continue;
+    }
+    if (!(message = bench_next(conn, 5000))){
+      failed[n]++;
+    }
+    else if (strstr(message, "Type /help")){
+      admitted[n]++;
+    }
+    else {
+      refused[n]++;
+    }
+    /* Hang up with a reset, so the ports don't pile up in TIME_WAIT */
+    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    bench_close(conn);
+  }
+  return NULL;
+}
+
+int main(){
+  pthread_t threads[STORMERS];
+  long total_admitted = 0, total_refused = 0, total_failed = 0;
+  double start, elapsed;
+  long i;
+
+  bench_server(PORT,
+	       "max_clients 256\n"
+	       "backlog 4096\n"
+	       "accept_batch 64\n", NULL);
+  start = bench_now();
+  for (i = 0; i < STORMERS; i++){
+    pthread_create(&threads[i], NULL, storm_loop, (void *)i);
+  }
+  sleep(DURATION);
+  running = 0;
+  for (i = 0; i < STORMERS; i++){
+    pthread_join(threads[i], NULL);
+    total_admitted += admitted[i];
+    total_refused += refused[i];
+    total_failed += failed[i];
+  }
+  elapsed = bench_now() - start;
+  bench_stop();
+
+  printf("connect_storm: %d threads, %.0f connects/s (%ld admitted, %ld refused, %ld without answer in %.2f s)\n",
+	 STORMERS, (total_admitted + total_refused) / elapsed,
+	 total_admitted, total_refused, total_failed, elapsed);
+  return 0;
+}
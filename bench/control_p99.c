@@ -0,0 +1,129 @@
+/* Latency of the control replies while the channel traffic is saturated.
+   FLOODERS clients say messages on a channel as fast as they can, to
+   RECEIVERS clients reading it. A probe client on the same channel asks
+   "/howmany" PROBES times and times each reply, which has to get ahead of
+   the channel messages queued for it. Fails if the p99 is over the bound,
+   P99_BOUND milliseconds or the first argument */
+
+#include "bench.h"
+
+#define PORT 5602
+#define FLOODERS 4
+#define RECEIVERS 16
+#define PROBES 500
+#define PROBE_INTERVAL 2000     /* Microseconds between two probes */
+#define P99_BOUND 100.0
+
+static bench_conn *flooders[FLOODERS];
+static bench_conn *receivers[RECEIVERS];
+static volatile int running = 1;
+static long flooded;            /* Channel messages received by the receivers */
+
+/* Say messages on the channel until the probes are done */
+void *flood_loop(void *arg){
+  bench_conn *conn = (bench_conn *)arg;
+  long i;
+  for (i = 0; running; i++){
+    bench_send(conn, "/tell bench bulk message number %ld, padded to look like chatter\n", i);
+  }
+  return NULL;
+}
+
+/* Read the channel on every receiver, and drain the flooders */
+void *receive_loop(void *arg){
+  struct pollfd pfds[RECEIVERS + FLOODERS];
+  bench_conn *conns[RECEIVERS + FLOODERS];
+  char *message;
+  int i, count = RECEIVERS + FLOODERS;
+  (void)arg;
+  for (i = 0; i < count; i++){
+    conns[i] = i < RECEIVERS ? receivers[i] : flooders[i - RECEIVERS];
+    pfds[i].fd = conns[i]->fd;
+    pfds[i].events = POLLIN;
+  }
+  while (running){
+    if (poll(pfds, count, 100) <= 0){
+      continue;
+    }
+    for (i = 0; i < count; i++){
+      if (!(pfds[i].revents & POLLIN)){
+	continue;
+      }
+      while ((message = bench_next(conns[i], 0))){
+	if (i < RECEIVERS && strstr(message, "bulk")){
+	  flooded++;
+	}
+	if (conns[i]->start == conns[i]->filled){
+	  break;
+	}
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv){
+  pthread_t threads[FLOODERS], receiver;
+  double latencies[PROBES], bound = argc > 1 ? atof(argv[1]) : P99_BOUND;
+  double start, sent, p50, p99, max;
+  bench_conn *probe;
+  int i;
+
+  bench_server(PORT,
+	       "max_clients 64\n"
+	       "max_users_by_channel 64\n"
+	       "presence_window 0\n", NULL);
+  for (i = 0; i < RECEIVERS + FLOODERS; i++){
+    bench_conn **conn = i < RECEIVERS ? &receivers[i] : &flooders[i - RECEIVERS];
+    if (!(*conn = bench_connect())){
+      bench_fail("connect");
+    }
+    bench_send(*conn, "/nick c%d\n/join bench\n", i);
+    if (!bench_expect(*conn, "Welcome to channel bench", 5000)){
+      bench_fail("join");
+    }
+  }
+  if (!(probe = bench_connect())){
+    bench_fail("connect");
+  }
+  bench_send(probe, "/nick probe\n/join bench\n");
+  if (!bench_expect(probe, "Welcome to channel bench", 5000)){
+    bench_fail("join");
+  }
+
+  pthread_create(&receiver, NULL, receive_loop, NULL);
+  for (i = 0; i < FLOODERS; i++){
+    pthread_create(&threads[i], NULL, flood_loop, flooders[i]);
+  }
+  /* Let the queues fill up */
+  usleep(200000);
+  start = bench_now();
+  for (i = 0; i < PROBES; i++){
+    sent = bench_now();
+    bench_send(probe, "/howmany bench\n");
+    if (!bench_expect(probe, "Users on channel bench", 5000)){
+      bench_fail("probe");
+    }
+    latencies[i] = (bench_now() - sent) * 1000;
+    usleep(PROBE_INTERVAL);
+  }
+  running = 0;
+  for (i = 0; i < FLOODERS; i++){
+    pthread_join(threads[i], NULL);
+  }
+  pthread_join(receiver, NULL);
+  printf("control_p99: %ld channel messages received meanwhile (%.0f/s)\n",
+	 flooded, flooded / (bench_now() - start));
+  bench_stop();
+
+  max = bench_quantile(latencies, PROBES, 1);
+  p50 = bench_quantile(latencies, PROBES, 0.5);
+  p99 = bench_quantile(latencies, PROBES, 0.99);
+  printf("control_p99: %d replies, p50 %.2f ms, p99 %.2f ms, max %.2f ms, bound %.2f ms\n",
+	 PROBES, p50, p99, max, bound);
+  if (p99 > bound){
+    printf("control_p99: FAILED, p99 over the bound\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+/* Cache misses of the server per message delivered on a channel.
+   RECEIVERS clients join a channel, one of them says MESSAGES messages on
+   it and every client counts what it gets. The hardware counter follows
+   every thread of the server from its start, so the misses of the setup
+   are included, spread over the RECEIVERS * MESSAGES deliveries */
+
+#include "bench.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PORT 5601
+#define RECEIVERS 32
+#define MESSAGES 20000
+#define QUIET 2000              /* Milliseconds without a message that end the run */
+
+static int counter = -1;        /* Cache misses of the server, -1 if unavailable */
+static int counter_error;       /* errno of perf_event_open when unavailable */
+static bench_conn *conns[RECEIVERS];
+static long delivered;          /* Messages of the run received by the clients */
+static double last;             /* When the last of them was received */
+
+/* Count the cache misses of the server and of the threads it starts */
+void open_counter(pid_t pid){
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  if ((counter = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0)) < 0){
+    counter_error = errno;
+  }
+}
+
+/* Count the messages of the run every client receives */
+void *receive_loop(void *arg){
+  struct pollfd pfds[RECEIVERS];
+  char *message;
+  int i;
+  (void)arg;
+  for (i = 0; i < RECEIVERS; i++){
+    pfds[i].fd = conns[i]->fd;
+    pfds[i].events = POLLIN;
+  }
+  while (poll(pfds, RECEIVERS, QUIET) > 0){
+    for (i = 0; i < RECEIVERS; i++){
+      if (!(pfds[i].revents & POLLIN)){
+	continue;
+      }
+      /* Take what was read without waiting for more */
+      while ((message = bench_next(conns[i], 0))){
+	if (strstr(message, "payload")){
+	  delivered++;
+	  last = bench_now();
+	}
+	if (conns[i]->start == conns[i]->filled){
+	  break;
+	}
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(){
+  pthread_t receiver;
+  long long misses = 0;
+  double start, elapsed;
+  int i;
+
+  bench_server(PORT,
+	       "max_clients 64\n"
+	       "max_users_by_channel 64\n"
+	       "cpu_affinity 1\n"
+	       "queue_size 16777216\n"
+	       "presence_window 0\n", open_counter);
+  for (i = 0; i < RECEIVERS; i++){
+    if (!(conns[i] = bench_connect())){
+      bench_fail("connect");
+    }
+    bench_send(conns[i], "/nick r%d\n/join bench\n", i);
+    if (!bench_expect(conns[i], "Welcome to channel bench", 5000)){
+      bench_fail("join");
+    }
+  }
+  pthread_create(&receiver, NULL, receive_loop, NULL);
+  start = bench_now();
+  for (i = 0; i < MESSAGES; i++){
+    bench_send(conns[0], "/tell bench payload %d\n", i);
+  }
+  pthread_join(receiver, NULL);
+  elapsed = last - start;
+  for (i = 0; i < RECEIVERS; i++){
+    bench_close(conns[i]);
+  }
+  bench_stop();
+
+  printf("deliver_misses: %d receivers, %d messages, %ld delivered in %.2f s (%.0f/s)\n",
+	 RECEIVERS, MESSAGES, delivered, elapsed, delivered / elapsed);
+  if (counter < 0){
+    printf("deliver_misses: cache misses unavailable (%s)\n", strerror(counter_error));
+  }
+  else if (read(counter, &misses, sizeof(misses)) == sizeof(misses) && delivered){
+    printf("deliver_misses: %lld cache misses, %.1f per delivered message\n",
+	   misses, (double)misses / delivered);
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+/* Parse microbenchmark: CPU time per line of the command parser of the
+   server, against the strtok and strcmp chain it replaced. The server is
+   compiled in, so parse_command and scan_delimiter are the ones it runs.
+   Both parse the same pipelined buffer of LINES lines ROUNDS times: the
+   server finds each line and classifies it in place, the old parser needs
+   a copy of the line it can cut with strtok */
+
+#define main server_main
+#include "../server.c"
+#undef main
+
+#define LINES 65536
+#define ROUNDS 20
+
+/* Lines of a busy channel: mostly chatter, some commands */
+static const char *samples[] = {
+  "hello everyone, how is it going today?\n",
+  "/tell room did anyone see the build results\n",
+  "/pm alice can you review my change\n",
+  "/join room\n",
+  "/who room 0 50\n",
+  "/howmany room\n",
+  "/me waves\n",
+  "/nick bob\n",
+  "/leave room\n",
+  "/help\n",
+};
+
+static const char *commands[] = {
+  "/nick", "/me", "/pm", "/join", "/tell", "/leave", "/who", "/howmany", "/quit", "/help"
+};
+
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The parser of the first server: a copy cut by strtok, then strcmp on
+   each command in turn until one matches, then the first argument */
+static int legacy_parse(const char *line, const char *end){
+  char copy[BUFFER_SIZE], *cmd, *arg;
+  int i, n = sizeof(commands) / sizeof(commands[0]);
+  memcpy(copy, line, end - line);
+  copy[end - line] = '\0';
+  if (copy[0] != '/'){
+    return -1;
+  }
+  cmd = strtok(copy, " \n");
+  for (i = 0; i < n && strcmp(cmd, commands[i]); i++);
+  arg = strtok(NULL, " \n\t");
+  return i + (arg ? *arg : 0);
+}
+
+int main(){
+  size_t size = 0, capacity = LINES * 64;
+  char *buffer = malloc(capacity);
+  const char *line, *end, *buffer_end;
+  command cmd;
+  double start, modern, legacy;
+  long sink = 0;
+  int i, round;
+
+  for (i = 0; i < LINES; i++){
+    size += sprintf(buffer + size, "%s", samples[i % (sizeof(samples) / sizeof(samples[0]))]);
+  }
+  buffer_end = buffer + size;
+
+  start = now();
+  for (round = 0; round < ROUNDS; round++){
+    for (line = buffer; line < buffer_end; line = end){
+      end = scan_delimiter(line, buffer_end, 0) + 1;
+      parse_command(line, end, &cmd);
+      sink += cmd.type + cmd.word_count;
+    }
+  }
+  modern = now() - start;
+
+  start = now();
+  for (round = 0; round < ROUNDS; round++){
+    for (line = buffer; line < buffer_end; line = end){
+      end = (const char *)memchr(line, '\n', buffer_end - line) + 1;
+      sink += legacy_parse(line, end);
+    }
+  }
+  legacy = now() - start;
+
+  printf("parse: %d lines, %.1f ns per line, strtok and strcmp %.1f ns per line, %.2fx (%ld)\n",
+	 LINES, modern * 1e9 / LINES / ROUNDS, legacy * 1e9 / LINES / ROUNDS,
+	 legacy / modern, sink & 1);
+  return 0;
+}
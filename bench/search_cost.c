@@ -0,0 +1,132 @@
+/* Cost of the /search index. A client says MESSAGES messages of WORDS words
+   on a channel, drawn from a vocabulary of VOCABULARY words with a fixed
+   seed. The CPU time of the indexer thread of the server gives the indexing
+   cost per message. Then QUERIES searches of one or two words are timed
+   from the command to the count of the messages found */
+
+#include "bench.h"
+#include <dirent.h>
+
+#define PORT 5604
+#define MESSAGES 50000
+#define WORDS 8
+#define VOCABULARY 2000
+#define QUERIES 1000
+#define SEED 42
+
+static volatile int running = 1;
+
+/* Return the CPU time in seconds of the thread named name of the server,
+   -1 if there is none */
+double thread_cpu(const char *name){
+  char path[64], comm[32], stat[1024], *fields;
+  unsigned long user, system;
+  struct dirent *entry;
+  double cpu = -1;
+  FILE *file;
+  DIR *tasks;
+  sprintf(path, "/proc/%d/task", (int)bench_pid);
+  if (!(tasks = opendir(path))){
+    return -1;
+  }
+  while (cpu < 0 && (entry = readdir(tasks))){
+    snprintf(path, sizeof(path), "/proc/%d/task/%.16s/comm", (int)bench_pid, entry->d_name);
+    if (!(file = fopen(path, "r"))){
+      continue;
+    }
+    if (fgets(comm, sizeof(comm), file) && !strncmp(comm, name, strlen(name)) &&
+	comm[strlen(name)] == '\n'){
+      snprintf(path, sizeof(path), "/proc/%d/task/%.16s/stat", (int)bench_pid, entry->d_name);
+      fclose(file);
+      if (!(file = fopen(path, "r"))){
+	continue;
+      }
+      /* utime and stime are the 12th and 13th fields after the name */
+      if (fgets(stat, sizeof(stat), file) && (fields = strrchr(stat, ')')) &&
+	  sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		 &user, &system) == 2){
+	cpu = (double)(user + system) / sysconf(_SC_CLK_TCK);
+      }
+    }
+    fclose(file);
+  }
+  closedir(tasks);
+  return cpu;
+}
+
+/* Drain what the server sends to the publisher */
+void *drain_loop(void *arg){
+  bench_conn *conn = (bench_conn *)arg;
+  while (running){
+    bench_next(conn, 100);
+  }
+  return NULL;
+}
+
+int main(){
+  pthread_t drainer;
+  double latencies[QUERIES], cpu, start, sent, elapsed;
+  bench_conn *publisher, *searcher;
+  char line[WORDS * 8 + 1], *end, *reply;
+  int i, j;
+
+  srand(SEED);
+  bench_server(PORT, "presence_window 0\n", NULL);
+  if (!(publisher = bench_connect()) || !(searcher = bench_connect())){
+    bench_fail("connect");
+  }
+  bench_send(publisher, "/nick publisher\n/join bench\n");
+  if (!bench_expect(publisher, "Welcome to channel bench", 5000)){
+    bench_fail("join");
+  }
+  bench_send(searcher, "/nick searcher\n");
+  pthread_create(&drainer, NULL, drain_loop, publisher);
+
+  cpu = thread_cpu("indexer");
+  start = bench_now();
+  for (i = 0; i < MESSAGES; i++){
+    for (end = line, j = 0; j < WORDS; j++){
+      end += sprintf(end, "w%d ", rand() % VOCABULARY);
+    }
+    bench_send(publisher, "/tell bench %s\n", line);
+  }
+  /* Only members search a channel, joined once the flood is published */
+  bench_send(searcher, "/join bench\n");
+  if (!bench_expect(searcher, "Welcome to channel bench", 5000)){
+    bench_fail("join");
+  }
+  /* Indexed in order: the last message is found once all of them are */
+  bench_send(publisher, "/tell bench lastmessage\n");
+  for (;;){
+    bench_send(searcher, "/search bench lastmessage\n");
+    if ((reply = bench_expect(searcher, "found on bench", 5000)) && !strncmp(reply, "1 message ", 10)){
+      break;
+    }
+    usleep(10000);
+  }
+  elapsed = bench_now() - start;
+  cpu = thread_cpu("indexer") - cpu;
+  printf("search_cost: %d messages of %d words indexed in %.2f s, indexer CPU %.2f s, %.2f us per message\n",
+	 MESSAGES, WORDS, elapsed, cpu, cpu * 1e6 / MESSAGES);
+
+  for (i = 0; i < QUERIES; i++){
+    sent = bench_now();
+    if (i % 2){
+      bench_send(searcher, "/search bench w%d w%d\n", rand() % VOCABULARY, rand() % VOCABULARY);
+    }
+    else {
+      bench_send(searcher, "/search bench w%d\n", rand() % VOCABULARY);
+    }
+    if (!bench_expect(searcher, "found on bench", 5000)){
+      bench_fail("search");
+    }
+    latencies[i] = (bench_now() - sent) * 1000;
+  }
+  running = 0;
+  pthread_join(drainer, NULL);
+  bench_stop();
+  printf("search_cost: %d queries, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", QUERIES,
+	 bench_quantile(latencies, QUERIES, 0.5), bench_quantile(latencies, QUERIES, 0.99),
+	 bench_quantile(latencies, QUERIES, 1));
+  return 0;
+}
@@ -0,0 +1,192 @@
+/* Throughput of a local bot on each transport: TCP, the Unix socket and
+   the shared ring of /shm. Like client.c, the bot writes each line on its
+   own. It first sends MESSAGES "/pong" lines, which the server reads and
+   drops, timed until the answer to a "/howmany" sent after them. Then it
+   says MESSAGES messages on a channel it is alone on, timed until the last
+   one comes back */
+
+#include "bench.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define PORT 5605
+#define UNIX_PATH "/tmp/chat-bench.sock"
+#define MESSAGES 200000
+
+/* Ring shared with the server after /shm, laid out as in server.c */
+typedef struct {
+  unsigned long head __attribute__((aligned(64))); /* Bytes written by the client */
+  int writer_waiting;           /* The client waits for room on the space eventfd */
+  unsigned long tail __attribute__((aligned(64))); /* Bytes read by the server */
+  int reader_waiting;           /* The server waits for bytes on the data eventfd */
+  char data[] __attribute__((aligned(64))); /* The ring itself, a power of two long */
+} shm_ring;
+
+static shm_ring *ring;          /* Ring of the bot, NULL if it writes to its socket */
+static size_t ring_size;
+static int ring_data, ring_space; /* Eventfds: bytes written, room made by the server */
+
+/* Ask the server for a ring and map it, as client.c does */
+void ring_open(bench_conn *conn){
+  union {
+    char buffer[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr *cmsg;
+  struct msghdr hdr;
+  struct iovec iov;
+  char buffer[BENCH_BUFFER], *message;
+  int fds[3] = { -1, -1, -1 };
+  ssize_t length;
+  bench_send(conn, "/shm\n");
+  for (;;){
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer) - 1;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buffer;
+    hdr.msg_controllen = sizeof(control.buffer);
+    if ((length = recvmsg(conn->fd, &hdr, MSG_CMSG_CLOEXEC)) <= 0){
+      bench_fail("recvmsg");
+    }
+    buffer[length] = '\0';
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)){
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+      }
+    }
+    if ((message = memmem(buffer, length, "\001SHM ", 5)) &&
+	sscanf(message + 5, "%zu", &ring_size) == 1){
+      break;
+    }
+  }
+  if (!ring_size || fds[0] < 0){
+    fprintf(stderr, "transport: the server refused the ring\n");
+    exit(1);
+  }
+  if ((ring = mmap(NULL, sizeof(shm_ring) + ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fds[0], 0)) == MAP_FAILED){
+    bench_fail("mmap");
+  }
+  close(fds[0]);
+  ring_data = fds[1];
+  ring_space = fds[2];
+}
+
+/* Write a line to the server, through the ring once there is one */
+void put(bench_conn *conn, const char *data, size_t length){
+  struct pollfd pfd = { ring_space, POLLIN, 0 };
+  unsigned long head, tail;
+  size_t n, first;
+  uint64_t value;
+  if (!ring){
+    bench_send(conn, "%.*s", (int)length, data);
+    return;
+  }
+  head = ring->head;
+  while (length > 0){
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ring_size){
+      __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail){
+	poll(&pfd, 1, -1);
+	if (read(ring_space, &value, sizeof(value)) < 0){
+	  bench_fail("read");
+	}
+      }
+      __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    n = ring_size - (head - tail);
+    if (n > length){
+      n = length;
+    }
+    first = ring_size - (head & (ring_size - 1));
+    if (first > n){
+      first = n;
+    }
+    memcpy(ring->data + (head & (ring_size - 1)), data, first);
+    memcpy(ring->data, data + first, n - first);
+    head += n;
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->reader_waiting, __ATOMIC_SEQ_CST)){
+      value = 1;
+      if (write(ring_data, &value, sizeof(value)) < 0){
+	bench_fail("write");
+      }
+    }
+    data += n;
+    length -= n;
+  }
+}
+
+/* Run both measures as a bot on transport: "tcp", "unix" or "shm" */
+void run(const char *transport){
+  bench_conn *conn = strcmp(transport, "tcp") ? bench_connect_unix(UNIX_PATH) : bench_connect();
+  char line[64], *message;
+  double start, ingest, publish;
+  long received = 0;
+  int i, length;
+  if (!conn){
+    bench_fail("connect");
+  }
+  ring = NULL;
+  bench_send(conn, "/nick %s-bot\n/join %s\n", transport, transport);
+  if (!bench_expect(conn, "Welcome to channel", 5000)){
+    bench_fail("join");
+  }
+  if (!strcmp(transport, "shm")){
+    ring_open(conn);
+  }
+
+  start = bench_now();
+  for (i = 0; i < MESSAGES; i++){
+    put(conn, "/pong\n", 6);
+  }
+  length = sprintf(line, "/howmany %s\n", transport);
+  put(conn, line, length);
+  if (!bench_expect(conn, "Users on channel", 10000)){
+    bench_fail("howmany");
+  }
+  ingest = bench_now() - start;
+
+  /* The bot reads its messages back between its writes, as a real one would */
+  start = bench_now();
+  for (i = 0; i < MESSAGES; i++){
+    length = sprintf(line, "/tell %s payload %d\n", transport, i);
+    put(conn, line, length);
+    while (!(i % 64) && (message = bench_next(conn, 0))){
+      received += strstr(message, "payload") != NULL;
+    }
+  }
+  sprintf(line, "payload %d\n", MESSAGES - 1);
+  while ((message = bench_next(conn, 2000))){
+    received += strstr(message, "payload") != NULL;
+    if (strstr(message, line)){
+      break;
+    }
+  }
+  publish = bench_now() - start;
+  if (ring){
+    munmap(ring, sizeof(shm_ring) + ring_size);
+    close(ring_data);
+    close(ring_space);
+  }
+  bench_close(conn);
+
+  printf("transport: %-4s ingest %.2f M lines/s, publish %.2f M messages/s (%ld of %d back)\n",
+	 transport, MESSAGES / ingest / 1e6, received / publish / 1e6, received, MESSAGES);
+}
+
+int main(){
+  bench_server(PORT,
+	       "unix_path " UNIX_PATH "\n"
+	       "queue_size 67108864\n"
+	       "presence_window 0\n", NULL);
+  run("tcp");
+  run("unix");
+  run("shm");
+  bench_stop();
+  return 0;
+}
@@ -3,6 +3,8 @@
   Client application
   ------------------------------------------------*/
 
+#define _GNU_SOURCE              /* for POLLRDHUP */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -11,6 +13,13 @@
 #include <netdb.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdint.h>
 
 /*--------- Define struct types ---------*/
 
@@ -18,82 +27,365 @@ typedef struct sockaddr sockaddr;
 typedef struct sockaddr_in sockaddr_in;
 typedef struct hostent hostent;
 
+/* Ring shared with the server after /shm, laid out as in server.c */
+typedef struct {
+  unsigned long head __attribute__((aligned(64))); /* Bytes written by the client */
+  int writer_waiting;           /* The client waits for room on the space eventfd */
+  unsigned long tail __attribute__((aligned(64))); /* Bytes read by the server */
+  int reader_waiting;           /* The server waits for bytes on the data eventfd */
+  char data[] __attribute__((aligned(64))); /* The ring itself, a power of two long */
+} shm_ring;
+
 /*--------- Define constants and global variables ---------*/
 
 #define MAX_NAME_SIZE 32        /* Maximum name size for users and channels */
-#define SERVER_PORT 5000         /* Port used for sin_port from sockaddr_in */
+#define SERVER_PORT 5000         /* Default port used for sin_port from sockaddr_in */
 #define BUFFER_SIZE 1024          /* Size of buffers used */
+#define CONTROL_MARK "\001"       /* Starts the messages of the server read by the client, PING, SHM and DATA */
 
 static int socket_descriptor;    /* socket descriptor */
+static shm_ring *ring;           /* Ring the messages are sent through after /shm, NULL before */
+static size_t ring_size;         /* Bytes of the ring */
+static int ring_data, ring_space; /* Eventfds: bytes written, room made by the server */
+static int shm_answered;         /* Set when the answer to /shm arrived */
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shm_cond = PTHREAD_COND_INITIALIZER;
+/* Held while writing to the server: the ring has a single producer, and a
+   PONG must not land inside the payload of a /send */
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Map the ring received with "SHM <size>", fds are the memfd and the two
+   eventfds. A size of 0 means the server refused, the socket is kept.
+   The server reads only from the ring once it sent it, so a ring that can't
+   be used ends the client */
+void shm_attach(size_t size, int *fds){
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+  shm_ring *r = MAP_FAILED;
+  struct stat st;
+  if (size) {
+    /* A ring that could change size under the mapping isn't safe to use */
+    if (fds[0] < 0 || (fcntl(fds[0], F_GET_SEALS) & seals) != seals ||
+	(size & (size - 1)) || fstat(fds[0], &st) < 0 ||
+	(size_t)st.st_size < sizeof(shm_ring) + size) {
+      fprintf(stderr, "error: the shared ring of the server isn't sealed at its size\n");
+      exit(1);
+    }
+    r = mmap(NULL, sizeof(shm_ring) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (r == MAP_FAILED) {
+      perror("error: unable to map the shared ring");
+      exit(1);
+    }
+  }
+  pthread_mutex_lock(&shm_lock);
+  if (r != MAP_FAILED) {
+    ring_size = size;
+    ring_data = fds[1];
+    ring_space = fds[2];
+    ring = r;
+  }
+  shm_answered = 1;
+  pthread_cond_signal(&shm_cond);
+  pthread_mutex_unlock(&shm_lock);
+}
+
+/* Write length bytes to the server: through the ring once the server gave
+   one, the server is only woken up when it waits. send_lock must be held.
+   Return -1 on error */
+int write_bytes(const char *data, size_t length){
+  struct pollfd fds[2];
+  unsigned long head, tail;
+  size_t n, first;
+  uint64_t value;
+  ssize_t written;
+  if (!ring) {
+    for (; length > 0; data += written, length -= written) {
+      if ((written = write(socket_descriptor, data, length)) < 0) {
+	return -1;
+      }
+    }
+    return 0;
+  }
+  fds[0].fd = ring_space;
+  fds[1].fd = socket_descriptor;
+  fds[0].events = POLLIN;
+  fds[1].events = POLLRDHUP;
+  head = ring->head;
+  while (length > 0) {
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ring_size) {
+      /* Full: sleep until the server made room, or left */
+      __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail) {
+	fds[1].revents = 0;
+	poll(fds, 2, -1);
+	if (fds[1].revents) {
+	  return -1;
+	}
+	read(ring_space, &value, sizeof(value));
+      }
+      __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    n = ring_size - (head - tail);
+    if (n > length) {
+      n = length;
+    }
+    first = ring_size - (head & (ring_size - 1));
+    if (first > n) {
+      first = n;
+    }
+    memcpy(ring->data + (head & (ring_size - 1)), data, first);
+    memcpy(ring->data, data + first, n - first);
+    head += n;
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->reader_waiting, __ATOMIC_SEQ_CST)) {
+      value = 1;
+      write(ring_data, &value, sizeof(value));
+    }
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/* Write length bytes to the server, from any thread. Return -1 on error */
+int send_bytes(const char *data, size_t length){
+  int result;
+  pthread_mutex_lock(&send_lock);
+  result = write_bytes(data, length);
+  pthread_mutex_unlock(&send_lock);
+  return result;
+}
+
+/* Ask the server for a shared ring and wait for its answer */
+void shm_request(){
+  if (ring) {
+    printf("Already sending through shared memory.\n");
+    return;
+  }
+  pthread_mutex_lock(&shm_lock);
+  shm_answered = 0;
+  pthread_mutex_unlock(&shm_lock);
+  send_bytes("/shm\n", 5);
+  pthread_mutex_lock(&shm_lock);
+  while (!shm_answered) {
+    pthread_cond_wait(&shm_cond, &shm_lock);
+  }
+  pthread_mutex_unlock(&shm_lock);
+  printf(ring ? "Sending through shared memory.\n" : "Sending through the socket.\n");
+}
 
 
 void *read_loop(void *arg){
-  int length;
-  char buffer[BUFFER_SIZE];
+  int length, start, end;
+  int kept = 0; /* bytes of a message cut by the end of the last read, moved to the front */
+  size_t data = 0; /* raw bytes of a transfer still to print */
+  size_t size; /* size of the ring given by the server */
+  char buffer[BUFFER_SIZE + 1];
   int socket_descriptor = *(int *)arg;
-  /* listen to the server answer */
-  while ((length = read(socket_descriptor, buffer, sizeof(buffer))) > 0) {
-    write(fileno(stdout),buffer,length);
+  int fds[3] = { -1, -1, -1 }; /* descriptors passed along with "SHM <size>" */
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov;
+  struct msghdr hdr;
+  struct cmsghdr *cmsg;
+  /* listen to the server answer, recvmsg also gets the descriptors of /shm */
+  for (;;) {
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base = buffer + kept;
+    iov.iov_len = BUFFER_SIZE - kept;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buffer;
+    hdr.msg_controllen = sizeof(control.buffer);
+    if ((length = recvmsg(socket_descriptor, &hdr, MSG_CMSG_CLOEXEC)) <= 0) {
+      break;
+    }
+    length += kept;
+    kept = 0;
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	  cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+      }
+    }
+    /* Messages end with '\0': answer the PINGs, print the rest */
+    for (start = 0; start < length; start = end) {
+      /* Chunk of a transfer, announced by CONTROL_MARK "DATA <size>\n" */
+      if (data > 0) {
+	end = start + (data < length - start ? data : length - start);
+	data -= end - start;
+	write(fileno(stdout), buffer + start, end - start);
+	continue;
+      }
+      for (end = start; end < length && buffer[end] != '\0'; end++);
+      /* Keep the start of a message for the next read, unless it fills the buffer */
+      if (end == length && start > 0) {
+	kept = length - start;
+	memmove(buffer, buffer + start, kept);
+	break;
+      }
+      if (end == length && length < BUFFER_SIZE) {
+	kept = length;
+	break;
+      }
+      if (end < length) {
+	end++;
+      }
+      else {
+	buffer[end] = '\0';
+      }
+      /* Only the server starts a message with CONTROL_MARK */
+      if (buffer[start] != CONTROL_MARK[0]) {
+	write(fileno(stdout), buffer + start, end - start);
+      }
+      else if (!strcmp(buffer + start + 1, "PING\n")) {
+	send_bytes("/pong\n", 6);
+      }
+      else if (sscanf(buffer + start + 1, "SHM %zu\n", &size) == 1) {
+	shm_attach(size, fds);
+      }
+      else {
+	sscanf(buffer + start + 1, "DATA %zu\n", &data);
+      }
+    }
   }
   return NULL;
 }
 
+/* Handle /sendfile <name|channel> <path>: send the file as a /send transfer,
+   straight from the page cache to the socket, or read into the ring.
+   send_lock is held from the command to the last byte, so the reader thread
+   answers a PING once the transfer is over */
+void send_file(int socket_descriptor, char *target, char *path){
+  int fd;
+  struct stat st;
+  char header[BUFFER_SIZE];
+  off_t offset = 0;
+  ssize_t n;
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror("error: unable to open the file");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  snprintf(header, sizeof(header), "/send %s %lld\n", target, (long long)st.st_size);
+  pthread_mutex_lock(&send_lock);
+  write_bytes(header, strlen(header));
+  while (ring && offset < st.st_size) {
+    if ((n = read(fd, header, sizeof(header))) <= 0 || write_bytes(header, n) < 0) {
+      perror("error: unable to send the file");
+      exit(1);
+    }
+    offset += n;
+  }
+  while (offset < st.st_size) {
+    if (sendfile(socket_descriptor, fd, &offset, st.st_size - offset) <= 0) {
+      perror("error: unable to send the file");
+      exit(1);
+    }
+  }
+  pthread_mutex_unlock(&send_lock);
+  close(fd);
+}
+
 int main(int argc, char **argv) {
   int msg_size; /* message size */
   sockaddr_in local_address;  /* socket local address */
+  struct sockaddr_un unix_address; /* path of the Unix socket of a local server */
   hostent * ptr_host;   /* informations about host machine */
   char *soft; /* software name */
+  int port; /* server port */
   char *host;  /* distant host name */
   char msg[BUFFER_SIZE];  /* sent message */
-  char name[MAX_NAME_SIZE]; /* user name */
+  char target[MAX_NAME_SIZE], path[BUFFER_SIZE]; /* arguments of /sendfile */
+  char name[3 * MAX_NAME_SIZE]; /* first messages: tenant and user name */
   pthread_t thread; /* thread to handle incoming messages from the server */
   char *cmd; /* command received */
 
-  if (argc != 3) {
-    perror("usage : client <server-address> <user-name>");
+  if (argc < 3 || argc > 5) {
+    fprintf(stderr, "usage : client <server-address|unix-socket-path> <user-name> [port] [tenant]\n");
     exit(1);
   }
   soft = argv[0];
   host = argv[1];
-  sprintf(name, "/nick %s", argv[2]);
-  printf("software name: %s ; server address: %s ; name chosen: %s \n", soft, host, name);
-
-  if ((ptr_host = gethostbyname(host)) == NULL) {
-    perror("error: cannot find server");
-    exit(1);
+  port = argc >= 4 ? atoi(argv[3]) : SERVER_PORT;
+  /* The tenant, if any, has to be the first message */
+  if (argc == 5) {
+    snprintf(name, sizeof(name), "/tenant %.*s\n/nick %.*s\n", MAX_NAME_SIZE - 1, argv[4],
+	     MAX_NAME_SIZE - 1, argv[2]);
   }
-  /* character copy of the ptr_host informations to local_address */
-  bcopy((char*)ptr_host->h_addr, (char*)&local_address.sin_addr, ptr_host->h_length);
-  local_address.sin_family = AF_INET; /* ou ptr_host->h_addrtype; */
-  /* use defined port */
-  local_address.sin_port = htons(SERVER_PORT);
-  /*-----------------------------------------------------------*/
-  printf("port number to use for server connection: %d \n", ntohs(local_address.sin_port));
-  /* define socket */
-  if ((socket_descriptor = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("error: unable to create the connection socket.");
-    exit(1);
+  else {
+    snprintf(name, sizeof(name), "/nick %s\n", argv[2]);
   }
-  /* attempt to connect to the server described in local_address */
-  if ((connect(socket_descriptor, (sockaddr*)(&local_address), sizeof(local_address))) < 0) {
-    perror("error: unable to connect to the server.");
-    exit(1);
+  printf("software name: %s ; server address: %s ; name chosen: %s \n", soft, host, argv[2]);
+
+  /* A path is the Unix socket of a server on the same host */
+  if (host[0] == '/') {
+    memset(&unix_address, 0, sizeof(unix_address));
+    unix_address.sun_family = AF_UNIX;
+    strncpy(unix_address.sun_path, host, sizeof(unix_address.sun_path) - 1);
+    if ((socket_descriptor = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	connect(socket_descriptor, (sockaddr*)(&unix_address), sizeof(unix_address)) < 0) {
+      perror("error: unable to connect to the server.");
+      exit(1);
+    }
+  }
+  else {
+    if ((ptr_host = gethostbyname(host)) == NULL) {
+      perror("error: cannot find server");
+      exit(1);
+    }
+    /* character copy of the ptr_host informations to local_address */
+    bcopy((char*)ptr_host->h_addr, (char*)&local_address.sin_addr, ptr_host->h_length);
+    local_address.sin_family = AF_INET; /* ou ptr_host->h_addrtype; */
+    /* use the given port */
+    local_address.sin_port = htons(port);
+    /*-----------------------------------------------------------*/
+    printf("port number to use for server connection: %d \n", ntohs(local_address.sin_port));
+    /* define socket */
+    if ((socket_descriptor = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+      perror("error: unable to create the connection socket.");
+      exit(1);
+    }
+    /* attempt to connect to the server described in local_address */
+    if ((connect(socket_descriptor, (sockaddr*)(&local_address), sizeof(local_address))) < 0) {
+      perror("error: unable to connect to the server.");
+      exit(1);
+    }
   }
   printf("Connection established. \n");
 
   /* Send name to the server */
-  write(socket_descriptor, name, strlen(name));
+  send_bytes(name, strlen(name));
 
   /* Handle the reception of messages from the server */
   pthread_create(&thread, NULL, read_loop, (void *)&socket_descriptor);
 
   /* Handle the sending of messages */
   /* read is blocking so the loop is used only when a message is read */
-  while ( (msg_size = read(fileno(stdin), msg, sizeof(msg))) > 0){
+  while ( (msg_size = read(fileno(stdin), msg, sizeof(msg) - 1)) > 0){
+    msg[msg_size] = '\0';
+
+    /* /shm is answered with the ring, the next messages go through it */
+    if (!strcmp(msg, "/shm\n")) {
+      shm_request();
+      continue;
+    }
+
+    /* /sendfile is handled here, the server only sees a /send */
+    if (sscanf(msg, "/sendfile %31s %1023s", target, path) == 2) {
+      send_file(socket_descriptor, target, path);
+      continue;
+    }
 
     /* send message to the server */
     /* printf("Sending message to the server. \n"); */
-    if ((write(socket_descriptor, msg, msg_size)) < 0) {
+    if (send_bytes(msg, msg_size) < 0) {
       perror("error: unable to send the message.");
       exit(1);
     }
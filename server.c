@@ -3,29 +3,116 @@
   Server-side application
   ------------------------------------------------*/
 
+#define _GNU_SOURCE              /* for accept4 */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <linux/types.h>
 #include <netdb.h>
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*--------- Define constants and global variables ---------*/
 
+#define BUFFER_SIZE 1024         /* Size of the buffers used for replies */
+#define MAX_NAME_SIZE 32         /* Size of the names of users and channels, final '\0' included */
+#define WRITE_BATCH 64           /* Maximum number of messages written by one system call */
+#define TIMER_TICK 100           /* Milliseconds between two ticks of the timer wheel */
+#define WHEEL_LEVELS 4           /* Number of levels of the timer wheel */
+#define WHEEL_BITS 6             /* Each level has 1 << WHEEL_BITS slots */
+#define TRANSFER_CHUNK 65536     /* Bytes of a /send relayed before other messages get a turn */
+
+/* Default settings, each one can be changed in the configuration file (see server.conf) */
 #define SERVER_PORT 5000         /* Port used for sin_port from sockaddr_in */
-#define BUFFER_SIZE 1024         /* Size of buffers used */
-#define MAX_NAME_SIZE 32         /* Maximum name size for users and channels */
 #define MAX_CLIENT_NUMBER 10     /* Maximum number of clients connected to the server */
 #define MAX_CHANNEL_NUMBER 10    /* Maximum number of channels on the server */
 #define MAX_USER_BY_CHANNEL 10   /* Maximum number of clients per channel */
+#define WHO_PAGE_SIZE 100        /* Number of names sent by /who at most, and when no limit is given */
+#define MAX_QUEUE_SIZE 262144    /* Bytes an outbound queue holds before dropping bulk messages */
+#define CONTROL_BACKLOG 4        /* Bytes of replies a queue holds, in queue_size, before its client is dropped */
+#define HANDSHAKE_TIMEOUT 10     /* Seconds a new client has to send its first message */
+#define IDLE_TIMEOUT 60          /* Seconds of silence before the server sends a PING */
+#define PONG_TIMEOUT 20          /* Seconds a client has to answer a PING */
+#define PRESENCE_WINDOW 1000     /* Milliseconds presence changes are gathered before being sent */
+#define LISTEN_BACKLOG 4096      /* Connections the kernel queues before they are accepted */
+#define ACCEPT_BATCH 64          /* Maximum number of connections accepted per wakeup */
+#define ACCEPT_BACKOFF 1         /* Seconds the listeners are left alone when out of fds with no reserve fd */
+#define MAX_TRANSFER_SIZE (64 << 20) /* Maximum size of a /send */
+#define SHM_RING_SIZE (1 << 20)  /* Bytes of the ring of a client sending through shared memory */
+
+/* Admin console */
+#define STATS_TOP 10             /* Entries of each view of the admin console */
+#define STATS_SHARDS 8           /* Counters of the commands, each shard on its own cache lines */
+#define STATS_PERIOD (1000 / TIMER_TICK) /* Ticks between two samples of the statistics */
+#define CLIENT_SHARDS 16         /* Parts of the registry of the clients, each with its lock */
+#define ADMIN_LOCKOUT_SLOTS 64   /* Addresses whose failed /admin logins are remembered */
+#define ADMIN_LOCKOUT_MAX 60     /* Seconds an address waits at most after failed /admin logins */
+#define MAX_WORDS 3              /* Words after a command kept by the parser */
+#define PRESENCE_NAMES 5         /* Names listed by a digest of presence changes */
+#define MAX_TENANTS 16           /* Tenants the configuration can declare */
+#define TENANT_SHARDS 8          /* Counters of a tenant, each on its own cache line */
+#define TENANT_HISTORY (1000 / TIMER_TICK) /* Ticks over which the message rate of a tenant is measured */
+#define CACHE_LINE 64            /* Bytes of a cache line */
+#define CONTROL_MARK "\001"      /* Starts the messages read by the client program, never sent by users */
+#define TEXT_SIZE 108            /* Size of the long settings, a Unix socket path or a password, final '\0' included */
+
+/* Search index */
+#define SEARCH_BUCKETS 256       /* Buckets of the table of the channel indexes */
+#define SEARCH_SEGMENT_SIZE 1024 /* Messages of a segment before a new one is started */
+#define SEARCH_SEGMENT_TIME 300  /* Seconds covered by a segment before a new one is started */
+#define SEARCH_RETENTION 65536   /* Messages kept per channel */
+#define SEARCH_MEMORY (64 << 20) /* Bytes of all the indexes before the oldest messages are dropped */
+#define SEARCH_QUEUE_SIZE 65536  /* Messages waiting to be indexed before new ones are dropped */
+#define SEARCH_RESULTS 20        /* Messages sent back by /search */
+#define SEARCH_MAX_TERMS 8       /* Words of a /search used */
+
+/* History of the channels */
+#define HISTORY_BUCKETS 256      /* Buckets of the table of the histories */
+#define HISTORY_RING 1024        /* Last messages of a channel kept in memory */
+#define HISTORY_SLOTS (2 * HISTORY_RING) /* Slots of the ring, the older ones wait there to be spilled */
+#define HISTORY_SPILL_MAX 65536  /* Messages of a part of the spill, two parts are kept */
+#define HISTORY_RETENTION 3600   /* Seconds an unused history is kept for /resume */
+#define HISTORY_REPLAY 256       /* Messages sent back by one /resume */
 
-static unsigned int clients_number = 0;  /* counts the client connected to the server */
+static unsigned int clients_number = 0;  /* counts the client connected to the server, atomic */
 static int id = 1;                       /* id of the client */
 static unsigned int channels_number = 0; /* counts the defined channels */
 static int socket_descriptor;            /* socket descriptor */
+static int unix_descriptor = -1;         /* Unix socket of the local clients, -1 if none */
+static int reserve_fd = -1;              /* fd kept aside to accept and close connections when out of fds */
+static unsigned long accept_paused_until; /* Tick before which the listeners aren't polled */
+static int client_capacity;              /* max_clients at startup */
+static int channel_capacity;             /* size of channels and of the subscriptions of a client */
+static int user_capacity;                /* size of the member list of a channel */
+static char *config_path;                /* configuration file, NULL to use the defaults */
+static volatile sig_atomic_t reload_requested; /* set by SIGHUP */
+static pthread_attr_t thread_attr;       /* attributes of the threads of the clients */
+static int cpu_count = 1;                /* CPUs online, one pool of clients each */
+static int next_cpu;                     /* CPU the next client is placed on */
+/* Protects the slots of the channels, their count and the list of tenants.
+   What belongs to a tenant is under the lock of the tenant, taken before
+   state_lock */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*--------- Define struct types ---------*/
@@ -35,637 +122,4645 @@ typedef struct sockaddr_in sockaddr_in;
 typedef struct hostent hostent;
 
 typedef struct channel_s channel;
+typedef struct tenant_s tenant;
+typedef struct client_s client;
 
-/* Client structure */
+/* Backends used to relay the payload of /send */
+enum {
+  IO_SPLICE,       /* Through pipes with splice and tee, no copy in user space */
+  IO_COPY          /* read and write through a buffer */
+};
+
+/* Quotas of a tenant, from a "tenant <name> <clients> <channels> <rate> <memory>" line */
 typedef struct {
-  sockaddr_in addr;     	/* Client remote address */
+  char name[MAX_NAME_SIZE];
+  int max_clients;                     /* Connections */
+  int max_channels;                    /* Channels */
+  int max_message_rate;                /* Messages per second of all its clients, 0 for no limit */
+  size_t max_memory;                   /* Bytes queued for its clients, 0 for no limit */
+} tenant_quota;
+
+/* Settings of the server. A snapshot is never modified once published, so
+   threads read it without locking; a reload publishes a new one */
+typedef struct {
+  /* Only read at startup */
+  char bind_address[INET_ADDRSTRLEN];  /* Address the server listens on */
+  int port;                            /* Port the server listens on */
+  int backlog;                         /* Size of the queue of pending connections */
+  size_t thread_stack_size;            /* Stack of the threads of a client, 0 for the default */
+  int cpu_affinity;                    /* 1 to pin the threads of each client to a CPU */
+  char unix_path[TEXT_SIZE];      /* Unix socket the local clients connect to, "" for none */
+  /* Reloaded on SIGHUP; limits can't go over their value at startup */
+  int max_clients;                     /* Maximum number of clients */
+  int max_channels;                    /* Maximum number of channels */
+  int max_users_by_channel;            /* Maximum number of clients per channel */
+  int max_name_length;                 /* Maximum length of a name */
+  int max_message_rate;                /* Messages per second per client, 0 for no limit */
+  size_t buffer_size;                  /* Bytes read at once from a new client */
+  size_t queue_size;                   /* Bytes an outbound queue holds */
+  size_t max_transfer_size;            /* Maximum size of a /send */
+  int accept_batch;                    /* Connections accepted per wakeup */
+  int who_page_size;                   /* Names sent by /who at most, and when no limit is given */
+  int handshake_timeout;               /* Seconds to send a first message */
+  int idle_timeout;                    /* Seconds of silence before a PING */
+  int pong_timeout;                    /* Seconds to answer a PING */
+  int io_backend;                      /* IO_SPLICE or IO_COPY */
+  int presence_window;                 /* Milliseconds presence changes are gathered, 0 to send them at once */
+  int history_spill;                   /* 1 to spill the history out of the ring to disk */
+  int history_retention;               /* Seconds the history of a removed channel is kept */
+  size_t shm_ring_size;                /* Bytes of the ring given by /shm, 0 to refuse it */
+  size_t search_memory;                /* Bytes of all the search indexes, the oldest messages are dropped over it */
+  char admin_password[TEXT_SIZE];      /* Password of /admin, "" to disable the admin console */
+  tenant_quota tenants[MAX_TENANTS + 1]; /* Declared tenants, and "default" */
+  int tenant_count;
+} config;
+
+/* Configuration replaced by a reload, freed once no thread can read it anymore */
+typedef struct retired_config_s {
+  config *cfg;
+  unsigned long epoch;                 /* config_epoch once it was replaced */
+  struct retired_config_s *next;       /* Older one */
+} retired_config;
+
+/* Thread reading the settings outside the main thread. Between config_enter
+   and config_leave, epoch is the config_epoch seen on entering, 0 outside */
+typedef struct config_reader_s {
+  unsigned long epoch;
+  struct config_reader_s *next;
+} __attribute__((aligned(CACHE_LINE))) config_reader;
+
+/* Types of the values of the configuration file */
+enum { CONFIG_INT, CONFIG_SIZE, CONFIG_STRING, CONFIG_TEXT, CONFIG_BACKEND, CONFIG_TENANT };
+
+/* Key of the configuration file */
+typedef struct {
+  char *key;
+  int type;
+  size_t offset;       /* Offset of the value in config */
+  int reloadable;      /* 0 if the value is only read at startup */
+} config_key;
+
+static const config_key config_keys[] = {
+  { "bind_address", CONFIG_STRING, offsetof(config, bind_address), 0 },
+  { "port", CONFIG_INT, offsetof(config, port), 0 },
+  { "backlog", CONFIG_INT, offsetof(config, backlog), 0 },
+  { "thread_stack_size", CONFIG_SIZE, offsetof(config, thread_stack_size), 0 },
+  { "cpu_affinity", CONFIG_INT, offsetof(config, cpu_affinity), 0 },
+  { "unix_path", CONFIG_TEXT, offsetof(config, unix_path), 0 },
+  { "max_clients", CONFIG_INT, offsetof(config, max_clients), 1 },
+  { "max_channels", CONFIG_INT, offsetof(config, max_channels), 1 },
+  { "max_users_by_channel", CONFIG_INT, offsetof(config, max_users_by_channel), 1 },
+  { "max_name_length", CONFIG_INT, offsetof(config, max_name_length), 1 },
+  { "max_message_rate", CONFIG_INT, offsetof(config, max_message_rate), 1 },
+  { "buffer_size", CONFIG_SIZE, offsetof(config, buffer_size), 1 },
+  { "queue_size", CONFIG_SIZE, offsetof(config, queue_size), 1 },
+  { "max_transfer_size", CONFIG_SIZE, offsetof(config, max_transfer_size), 1 },
+  { "accept_batch", CONFIG_INT, offsetof(config, accept_batch), 1 },
+  { "who_page_size", CONFIG_INT, offsetof(config, who_page_size), 1 },
+  { "handshake_timeout", CONFIG_INT, offsetof(config, handshake_timeout), 1 },
+  { "idle_timeout", CONFIG_INT, offsetof(config, idle_timeout), 1 },
+  { "pong_timeout", CONFIG_INT, offsetof(config, pong_timeout), 1 },
+  { "io_backend", CONFIG_BACKEND, offsetof(config, io_backend), 1 },
+  { "presence_window", CONFIG_INT, offsetof(config, presence_window), 1 },
+  { "history_spill", CONFIG_INT, offsetof(config, history_spill), 1 },
+  { "history_retention", CONFIG_INT, offsetof(config, history_retention), 1 },
+  { "shm_ring_size", CONFIG_SIZE, offsetof(config, shm_ring_size), 1 },
+  { "search_memory", CONFIG_SIZE, offsetof(config, search_memory), 1 },
+  { "admin_password", CONFIG_TEXT, offsetof(config, admin_password), 1 },
+  { "tenant", CONFIG_TENANT, offsetof(config, tenants), 1 },
+  { NULL }
+};
+
+/* Timer armed on the timer wheel */
+typedef struct timer_s {
+  struct timer_s *next;          /* Next timer in the same slot */
+  struct timer_s **pprev;        /* Link pointing to this timer, NULL when not armed */
+  unsigned long expires;         /* Tick at which the timer fires */
+  void (*callback)(struct timer_s *);
+} timer;
+
+/* Hierarchical timer wheel: level 0 holds the timers of the next
+   1 << WHEEL_BITS ticks, each level above holds 1 << WHEEL_BITS times longer
+   spans and is cascaded down when level 0 wraps, so arming and cancelling
+   a timer are O(1) whatever the number of timers. The callbacks run without
+   the lock, one at a time */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;                                /* Signaled when a callback returns */
+  timer *running;                                     /* Timer whose callback runs, or NULL */
+  unsigned long now;                                  /* Current tick */
+  timer *slots[WHEEL_LEVELS][1 << WHEEL_BITS];
+} timer_wheel;
+
+/* Priority classes of outbound messages, from the most to the least urgent */
+enum {
+  PRIO_CONTROL,    /* Replies to commands */
+  PRIO_PRIVATE,    /* Private messages */
+  PRIO_CHANNEL,    /* Channel and global messages */
+  PRIO_HISTORY,    /* Replay of past messages */
+  PRIO_CLASSES
+};
+
+/* Quantum of bytes given to each class on every round of the writer */
+static const int prio_quantum[PRIO_CLASSES] = {
+  8 * BUFFER_SIZE, 4 * BUFFER_SIZE, 2 * BUFFER_SIZE, BUFFER_SIZE
+};
+
+/* Message waiting to be written, shared by all its recipients */
+typedef struct {
+  int refs;            /* Number of queues holding the message */
+  size_t length;       /* Length of data, final '\0' included */
+  char data[];         /* Message */
+} message;
+
+/* Acknowledgement of a user on a channel */
+typedef struct acked_s {
+  char name[MAX_NAME_SIZE];      /* User */
+  unsigned long seq;             /* Last message acknowledged */
+  struct acked_s *next;
+} acked;
+
+/* Part of the messages of a history spilled to a temporary file */
+typedef struct {
+  FILE *file;                    /* NULL until its first message */
+  off_t size;                    /* Bytes written */
+  off_t *offsets;                /* offsets[i] is where message first + i starts */
+  unsigned long first;           /* Sequence number of its first message */
+  unsigned long count;           /* Messages written, HISTORY_SPILL_MAX at most */
+  unsigned long capacity;        /* Offsets allocated */
+} history_spill;
+
+/* Sequenced messages of a channel, kept after the channel is removed so
+   that a client coming back can resume it, until nobody used it for
+   history_retention. The last ones stay in a ring, the older ones are
+   spilled to a temporary file in two parts: when the newest is full,
+   the oldest is dropped. The files are only written, created and closed
+   with spill_lock held, never with the lock of a tenant */
+typedef struct history_s {
+  tenant *tenant;
+  char name[MAX_NAME_SIZE];
+  pthread_mutex_t lock;          /* Taken after the lock of its tenant and spill_lock */
+  pthread_mutex_t spill_lock;    /* Serializes the writes to the spill */
+  int refs;                      /* Channel and commands using it, the first one is taken with history_table_lock */
+  unsigned long released;        /* Tick refs last dropped to 0 */
+  unsigned long last;            /* Sequence number of the last message, 0 before the first */
+  unsigned long ring_first;      /* Sequence number of the oldest message in ring, last + 1 if none */
+  message *ring[HISTORY_SLOTS];  /* Message seq is in ring[seq % HISTORY_SLOTS] */
+  history_spill spill[2];        /* Messages pushed out of the ring, spill[0] before spill[1] */
+  int spill_gap;                 /* Set when a message was lost between the spill and the ring */
+  acked *acks;                   /* Acknowledgements of the users */
+  struct history_s *next;        /* Next history in the same bucket */
+} history;
+
+/* Element of an outbound queue */
+typedef struct queued_s {
+  message *msg;
+  struct queued_s *next;
+} queued;
+
+/* Outbound queue of a client, flushed by its writer thread */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;                  /* Signaled when a message is queued */
+  queued *head[PRIO_CLASSES];            /* Next message of each class */
+  queued *tail[PRIO_CLASSES];            /* Last message of each class */
+  size_t deficit[PRIO_CLASSES];          /* Bytes each class may still send this round */
+  int current;                           /* Class served by the writer */
+  int granted;                           /* 1 if current got its quantum this round */
+  size_t bytes;                          /* Bytes waiting in the queue */
+  unsigned long dropped;                 /* Messages dropped because the queue was full */
+  int closing;                           /* Set when the client leaves */
+  int dead;                              /* Set when the connection can't be written anymore */
+  pthread_t writer;                      /* Thread flushing the queue */
+  pthread_mutex_t write_lock;            /* Held while writing to the connection */
+  pthread_cond_t flushed;                /* Signaled when a batch is written or a transfer ends */
+  unsigned long flushes;                 /* Number of batches written */
+  int transfers;                         /* Number of /send relayed to the client right now */
+  tenant *tenant;                        /* Tenant charged for the bytes, NULL until the client enters one */
+  long *charged;                         /* Memory counter of the tenant charged */
+} outqueue;
+
+/* Hash table of named entries, clients or channels, chained through the
+   pointer at offset link in each entry. It doubles once it has as many
+   entries as buckets, so a lookup stays O(1) */
+typedef struct {
+  void **buckets;
+  unsigned int size;             /* Number of buckets, a power of 2, or 0 */
+  unsigned int count;            /* Number of entries */
+  size_t link;                   /* Offset of the next entry of the bucket in an entry */
+  size_t name;                   /* Offset of the name in an entry */
+} name_index;
+
+/* Members of a channel or of a tenant, in no particular order. Each member
+   keeps its position, so a join, a leave or a rename is O(1), and the names
+   are kept next to the members: /who copies a page of them, nothing is
+   rendered again */
+typedef struct {
+  client **clients;
+  char (*names)[MAX_NAME_SIZE];  /* names[i] is the name of clients[i] */
+  int **slots;                   /* slots[i] is where clients[i] keeps i */
+  int count;
+  int capacity;
+} member_list;
+
+/* Channel a client is on, kept at the id of the channel */
+typedef struct {
+  channel *chan;                 /* NULL if the client isn't on the channel of this id */
+  int slot;                      /* Position of the client in the members of chan */
+} subscription;
+
+/* Counters of a tenant. The threads of its clients add to their own shard,
+   the accounting timer sums them */
+typedef struct {
+  unsigned long messages;       /* Messages accepted from its clients */
+  long memory;                  /* Bytes queued for its clients */
+} __attribute__((aligned(CACHE_LINE))) tenant_shard;
+
+/* Namespace of a team: its users only see its users and channels. Its
+   lock covers its members, its channels and their members, so what a
+   tenant does never waits for another tenant */
+struct tenant_s {
+  char name[MAX_NAME_SIZE];
+  pthread_mutex_t lock;
+  member_list members;                  /* Its users */
+  name_index users;                     /* Its users by name */
+  name_index channels;                  /* Its channels by name */
+  int channels_number;                  /* Number of its channels */
+  tenant_shard shards[TENANT_SHARDS];
+  unsigned long history[TENANT_HISTORY]; /* Messages counted at each of the last ticks */
+  int throttled;                        /* Set while over its message rate */
+  int over_memory;                      /* Set while over its memory */
+  struct tenant_s *next;                /* Tenants are never freed, so the list is read unlocked */
+};
+
+/* Ring of the bytes a local client sends through shared memory instead of
+   its socket. The client only moves head and the server only moves tail,
+   each on its own cache line. A side about to sleep on its eventfd sets its
+   flag, so the other side only makes a system call to wake it up then */
+typedef struct {
+  unsigned long head __attribute__((aligned(CACHE_LINE))); /* Bytes written by the client */
+  int writer_waiting;           /* The client waits for room on the space eventfd */
+  unsigned long tail __attribute__((aligned(CACHE_LINE))); /* Bytes read by the server */
+  int reader_waiting;           /* The server waits for bytes on the data eventfd */
+  char data[] __attribute__((aligned(CACHE_LINE))); /* The ring itself, a power of two long */
+} shm_ring;
+
+/* Client structure. The fields are grouped by the threads writing them,
+   each group on its own cache lines, so that queuing a message for a
+   client doesn't invalidate the lines its reader thread writes */
+struct client_s {
+  /* Read by every thread sending to the client, rarely written */
   int cli_co;			/* Informations about client*/
+  int presence;                 /* 0 if the client doesn't want the presence changes */
+  tenant *tenant;               /* Namespace of the client, NULL until its first message */
+  char name[MAX_NAME_SIZE];     /* Client name, compared by the lookups */
+  client *name_next;            /* Next client of its bucket in the users of its tenant */
+  /* Written by the threads queuing messages and by the writer */
+  outqueue out __attribute__((aligned(CACHE_LINE))); /* Messages waiting to be sent */
+  /* Written by the thread reading the client */
+  unsigned long last_seen __attribute__((aligned(CACHE_LINE))); /* Tick of the last message received, 0 before the first one */
+  unsigned long rate_start;     /* Tick starting the second counted by rate_count */
+  int rate_count;               /* Messages received during that second */
+  unsigned long throttle_warned; /* Tick of the last warning about the rate of its tenant */
+  shm_ring *shm;                /* Ring its messages come through after /shm, NULL before */
+  size_t shm_size;              /* Bytes of the ring */
+  unsigned long shm_tail;       /* Bytes read from the ring, the client can't change this copy */
+  int shm_data;                 /* Eventfd written by the client when it fills the ring */
+  int shm_space;                /* Eventfd written by the server when it empties the ring */
+  unsigned long messages;       /* Messages accepted, read by the stats timer */
+  int admin;                    /* 1 once logged in with /admin */
+  /* Written by the timers and when connecting */
+  timer keepalive __attribute__((aligned(CACHE_LINE))); /* Handshake, idle and PONG deadlines */
+  int pinged;                   /* 1 if a PING is waiting for its answer */
+  unsigned long messages_sampled; /* Value of messages at the last sample of the stats */
+  sockaddr_in addr;     	/* Client remote address */
   int id;			/* Client identifier */
-  char name[MAX_NAME_SIZE];     /* Client name */
-  channel *sub_chan[MAX_CHANNEL_NUMBER];   /* Subscribed channels */
-} client;
+  int cpu;                      /* CPU its threads are pinned to, -1 if not pinned */
+  int tenant_slot;              /* Position in the members of its tenant */
+  client *shard_next;           /* Next client of its shard of the registry */
+  client **shard_prev;          /* Link to the client in its shard */
+  subscription *subs;           /* Channels it is on by channel id, channel_capacity of them */
+};
+
+/* Part of the registry of the connected clients, which holds the clients
+   of the ids equal to its index modulo CLIENT_SHARDS */
+typedef struct {
+  pthread_mutex_t lock;
+  client *first;
+} __attribute__((aligned(CACHE_LINE))) client_shard;
+
+/* Clients freed, kept to be reused by the next clients placed on the same CPU */
+typedef struct {
+  pthread_mutex_t lock;
+  void *free;                   /* Freed clients, linked through their first bytes */
+} __attribute__((aligned(CACHE_LINE))) client_pool;
+
+/* Connection accepted by the main thread, handed over to the thread of its
+   client, which allocates and fills the client on the CPU it is pinned to */
+typedef struct {
+  int fd;
+  sockaddr_in addr;             /* Remote address */
+  int id;                       /* Identifier given to the client */
+  int cpu;                      /* CPU the client is placed on, -1 if none */
+} arrival;
+
+/* What the core of the server (commands, clients, channels, timers) needs
+   from the outside world. socket_ops runs it on sockets and threads. A
+   driver can install its own before core_start, deliver into memory, feed
+   the bytes of its clients to client_input, advance the timer wheel with
+   its own clock and index with search_step, all from one thread, as
+   test/sim.c does */
+typedef struct {
+  int (*deliver)(client *cli, message *m, int prio); /* Queue a message for a client */
+  int (*transfer)(client *cli, char *target, size_t size,
+		  const char *pending, size_t pending_length); /* Relay a /send */
+  void (*disconnect)(client *cli);               /* Make a client leave, from any thread */
+  time_t (*wall_time)(void);                     /* Date of the messages indexed */
+  int (*upgrade)(client *cli);                   /* Answer /shm, NULL if not supported */
+  void (*charge)(client *cli, tenant *t);        /* Charge t for what waits for cli, lock of t held */
+  FILE *(*spill_file)(void);                     /* Open a file for the spilled history */
+} server_ops;
+
+/* Kinds of presence changes */
+enum { PRESENCE_JOINED, PRESENCE_LEFT, PRESENCE_KINDS };
+
+/* Presence changes of the server or of a channel gathered during a window,
+   sent as one digest so a reconnection storm costs O(N) messages, not O(N²) */
+typedef struct presence_digest_s {
+  tenant *tenant;
+  char channel[MAX_NAME_SIZE];                  /* Channel name, "" for the whole tenant */
+  int count[PRESENCE_KINDS];                    /* Changes of each kind */
+  char names[PRESENCE_KINDS][PRESENCE_NAMES][MAX_NAME_SIZE]; /* First names of each kind */
+  struct presence_digest_s *next;
+} presence_digest;
+
+/* Message kept by the search index */
+typedef struct {
+  time_t time;                  /* Reception time */
+  char sender[MAX_NAME_SIZE];   /* Name of the sender */
+  char text[];                  /* Message */
+} indexed_message;
+
+/* Ids of the messages of a segment holding a term, as varint encoded deltas */
+typedef struct {
+  char *term;                   /* NULL for a free slot of the table */
+  unsigned char *data;          /* Encoded deltas */
+  size_t length;                /* Bytes used in data */
+  size_t capacity;              /* Bytes allocated for data */
+  unsigned int last;            /* Last id added */
+  unsigned int count;           /* Number of ids */
+} posting_list;
+
+/* Slice of the messages of a channel, with its own term dictionary.
+   Only the last segment of a channel receives messages, the others are
+   never modified: they are merged into new segments in the background */
+typedef struct {
+  indexed_message **messages;   /* Messages, oldest first */
+  unsigned int message_count;
+  unsigned int message_capacity;
+  posting_list *terms;          /* Open addressing table of the terms */
+  unsigned int term_count;
+  unsigned int term_capacity;   /* Power of 2 */
+  time_t start;                 /* Time of the first message */
+  size_t bytes;                 /* Memory used, the messages included */
+  size_t message_bytes;         /* Memory used by the messages */
+} segment;
+
+/* Index of the messages of a channel, dropped when the channel is removed */
+typedef struct search_channel_s {
+  tenant *tenant;
+  char name[MAX_NAME_SIZE];
+  pthread_rwlock_t lock;        /* Read by queries, written when swapping segments */
+  segment **segments;           /* Oldest first, the last one receives the new messages */
+  int segment_count;
+  int segment_capacity;
+  unsigned int message_count;   /* Messages in all the segments */
+  struct search_channel_s *next; /* Next index in the same bucket */
+} search_channel;
 
-/* Channel structure */
+/* Message waiting to be indexed */
+typedef struct pending_message_s {
+  tenant *tenant;
+  char channel[MAX_NAME_SIZE];
+  indexed_message *msg;          /* NULL to drop the index of the channel */
+  struct pending_message_s *next;
+} pending_message;
+
+/* Channel structure, the fields read by each message sent on it first */
 struct channel_s {
+  member_list members;                        /* Users on the channel */
+  tenant *tenant;                             /* Namespace of the channel */
   char name[MAX_NAME_SIZE];                   /* Channel name */
   int id;                                     /* Channel index */
-  int client_number;                          /* Number of user on the channel */
-  client *chan_clients[MAX_USER_BY_CHANNEL];  /* Array of client */
+  channel *name_next;                         /* Next channel of its bucket in its tenant */
+  history *history;                           /* Sequenced messages of the channel */
+  int cpu;                                    /* CPU whose pool the channel goes back to */
+  channel *next_free;                         /* Next channel of the pool once removed */
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Commands of the clients */
+enum {
+  CMD_MESSAGE,   /* Not a command: said on global */
+  CMD_NICK,
+  CMD_ME,
+  CMD_PM,
+  CMD_JOIN,
+  CMD_TELL,
+  CMD_LEAVE,
+  CMD_WHO,
+  CMD_HOWMANY,
+  CMD_SEARCH,
+  CMD_SEND,
+  CMD_ACK,
+  CMD_RESUME,
+  CMD_SHM,
+  CMD_ADMIN,
+  CMD_PRESENCE,
+  CMD_TENANT,
+  CMD_PONG,
+  CMD_QUIT,
+  CMD_HELP,
+  CMD_UNKNOWN
 };
 
+/* Commands whose first word is the name of a user or a channel */
+#define NAMED_COMMANDS (1 << CMD_NICK | 1 << CMD_PM | 1 << CMD_JOIN | 1 << CMD_TELL | \
+			1 << CMD_LEAVE | 1 << CMD_WHO | 1 << CMD_HOWMANY | 1 << CMD_SEARCH | \
+			1 << CMD_SEND | 1 << CMD_ACK | 1 << CMD_RESUME)
+
+/* Line received, split without copying nor modifying the buffer */
+typedef struct {
+  int type;                      /* CMD_* */
+  int word_count;                /* Words found after the command, at most MAX_WORDS */
+  const char *word[MAX_WORDS];   /* Start of each word */
+  size_t word_length[MAX_WORDS];
+  const char *rest[MAX_WORDS + 1]; /* Rest of the line after the command and after each word */
+  const char *end;               /* End of the line, after its '\n' */
+} command;
+
+/* Counters of the commands received. The thread reading a client adds to
+   the shard of the client, the stats timer sums them */
+typedef struct {
+  unsigned long commands[CMD_UNKNOWN + 1];
+} __attribute__((aligned(CACHE_LINE))) stats_shard;
+
+/* Entry of a view of the admin console */
+typedef struct {
+  char tenant[MAX_NAME_SIZE];
+  char name[MAX_NAME_SIZE];
+  unsigned long value;          /* What the view is sorted by */
+  unsigned long extra;          /* Messages dropped, for the slowest clients */
+} stats_entry;
+
+/* Statistics sampled every STATS_PERIOD by the stats timer. The admin
+   console only reads this copy, never the state of the server */
+typedef struct {
+  stats_entry talkers[STATS_TOP];        /* Messages accepted during the last period */
+  stats_entry channels[STATS_TOP];       /* Users on the channel */
+  stats_entry slow[STATS_TOP];           /* Bytes waiting in the outbound queue */
+  int talker_count, channel_count, slow_count;
+  unsigned long rates[CMD_UNKNOWN + 1];  /* Commands received during the last period */
+  unsigned long totals[CMD_UNKNOWN + 1]; /* Commands received since the start */
+} stats_sample;
+
+/* Failed /admin logins from an address, IPv4 or 0 for the local clients */
+typedef struct {
+  uint32_t addr;
+  int failures;                 /* Failures in a row */
+  unsigned long until;          /* Tick before which the address can't try again */
+} admin_attempts;
+
+/* Node of the trie of the banned IPv4 prefixes, one level per bit.
+   Nodes are never freed, so accept walks the trie without locking */
+typedef struct ban_node_s {
+  struct ban_node_s *child[2];
+  int banned;                   /* 1 if the prefix ending at this node is banned */
+} ban_node;
+
 
-client *clients[MAX_CLIENT_NUMBER];
-channel *channels[MAX_CHANNEL_NUMBER];
+static client_shard client_shards[CLIENT_SHARDS]; /* Connected clients */
+channel **channels;  /* channel_capacity channels */
+static const server_ops *ops; /* Set by main, or by another driver */
+static client_pool *client_pools; /* cpu_count pools */
+static channel **channel_pools; /* cpu_count lists of removed channels, state_lock */
+static int *free_channel_ids;   /* Ids of the free slots of channels, state_lock */
+static tenant *tenants;        /* Tenants entered so far */
+static timer tenant_timer;     /* Sums the counters of the tenants every tick */
+static timer_wheel wheel = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER }; /* Timers of the server */
+static config *current_config; /* Settings in use, replaced as a whole on reload */
+static retired_config *retired_configs; /* Replaced settings, newest first, main thread only */
+static unsigned long config_epoch = 1;  /* Number of reloads, plus 1 */
+static config_reader *config_readers;  /* Registered readers, config_readers_lock */
+static pthread_mutex_t config_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread config_reader *config_self; /* Reader of the calling thread, NULL if none */
+static search_channel *search_table[SEARCH_BUCKETS]; /* Indexes by channel name */
+static pthread_mutex_t search_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pending_message *search_head, *search_tail;    /* Messages waiting for the indexer */
+static int search_pending;                             /* Number of them */
+static unsigned long search_dropped;                   /* Messages not indexed, queue full */
+static size_t search_memory;                           /* Bytes of all the indexes, indexer thread only */
+static pthread_mutex_t search_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t search_queue_ready = PTHREAD_COND_INITIALIZER;
+static history *history_table[HISTORY_BUCKETS];       /* Histories by channel name */
+static pthread_mutex_t history_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer history_timer;                           /* Frees the unused histories */
+static presence_digest *presence_pending;             /* Changes of the current window */
+static pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER; /* Protects presence_pending */
+static timer presence_timer;                          /* Ends the current window */
+static stats_shard command_stats[STATS_SHARDS];       /* Commands received */
+static stats_sample stats;                            /* Last sample, stats_lock */
+static stats_sample stats_partial;                    /* Sample being taken, stats timer only */
+static int stats_slice;                               /* Slices of the period taken so far */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer stats_timer;                             /* Takes the samples */
+static ban_node ban_root;                             /* Banned prefixes */
+static pthread_mutex_t ban_lock = PTHREAD_MUTEX_INITIALIZER; /* Serializes the changes of the bans */
+static admin_attempts admin_lockouts[ADMIN_LOCKOUT_SLOTS]; /* By address, admin_lock */
+static pthread_mutex_t admin_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*--------- Functions ---------*/
 
-/* Send a message to all clients */
-void send_message_to_all(char *msg){
-  int i;
-  for (i = 0; i < MAX_CLIENT_NUMBER; i++) {
-    if (clients[i]) {
-      if ((write(clients[i]->cli_co, msg, strlen(msg)+1)) < 0){
-	perror("error: failing to send message to clients");
-      }
-    }
-  }
+/* Return the settings in use. Outside the main thread, the snapshot stays
+   valid until the calling thread calls config_leave */
+static inline config *config_get(){
+  return __atomic_load_n(&current_config, __ATOMIC_SEQ_CST);
 }
 
-/* Send a message to the client given by cli_co */
-void send_message_to_client(char *msg, int cli_co){
-  if (write(cli_co, msg, strlen(msg)+1) < 0){
-    perror("error: failing to send message to client");
-  }
+/* Register the calling thread as a reader of the settings, r lives as long
+   as the thread */
+void config_register(config_reader *r){
+  r->epoch = 0;
+  pthread_mutex_lock(&config_readers_lock);
+  r->next = config_readers;
+  config_readers = r;
+  pthread_mutex_unlock(&config_readers_lock);
+  config_self = r;
 }
 
-/* Send a message to the clients in a specific channel */
-void send_message_to_channel(char *msg, int index){
-  int i;
-  for (i = 0; i < MAX_USER_BY_CHANNEL; i++){
-    if (channels[index]->chan_clients[i]) {
-      if ((write(channels[index]->chan_clients[i]->cli_co, msg, strlen(msg)+1)) < 0){
-	perror("error: failing to send message to clients");
-      }
-    }
-  }
+/* Unregister the calling thread, which must be out of config_enter */
+void config_unregister(){
+  config_reader **link;
+  pthread_mutex_lock(&config_readers_lock);
+  for (link = &config_readers; *link != config_self; link = &(*link)->next);
+  *link = config_self->next;
+  pthread_mutex_unlock(&config_readers_lock);
+  config_self = NULL;
 }
 
-
-/* Find a client in the list using the name given,
-return client cli_co if found
-or -1 if name is not found */
-int find_client_by_name(char *name){
-  int i;
-  for (i = 0; i < MAX_CLIENT_NUMBER; i++) {
-    if (clients[i]) {
-      /* Compare client name with the name given,
-	 srcmp == 0 if the arguments are equal */
-      if (!strcmp(clients[i]->name, name)){
-	/* Return client cli_co if found */
-	return clients[i]->cli_co;
-      }
-    }
+/* Start using the settings: no snapshot read from now on is freed before
+   config_leave. Nothing to do on a thread not registered */
+void config_enter(){
+  if (config_self){
+    __atomic_store_n(&config_self->epoch, __atomic_load_n(&config_epoch, __ATOMIC_SEQ_CST),
+		     __ATOMIC_SEQ_CST);
   }
-  return -1;
 }
 
-/* Enable the handling of signals */
-void signal_handler(int signal_number){
-  int i;
-  printf("Received signal: %s\n", strsignal(signal_number));
-  /* Warn the clients that the server is closing */
-  if (signal_number == SIGINT) {
-      for (i = 0; i < MAX_CLIENT_NUMBER; i++) {
-	if (clients[i]) {
-	  send_message_to_client("Server disconnected.\n", clients[i]->cli_co);
-	  close(clients[i]->cli_co);
-	  free(clients[i]);
-	}
-      }
-    close(socket_descriptor);
+/* Stop using the settings, before blocking for a while */
+void config_leave(){
+  if (config_self){
+    __atomic_store_n(&config_self->epoch, 0, __ATOMIC_RELEASE);
   }
-  exit(signal_number);
 }
 
-/* Add a client to the client list and increase the number of clients */
-void add_client(client *cli){
-  int i;
-  for (i = 0; i < MAX_CLIENT_NUMBER; i++) {
-    if (!clients[i]) {
-      clients[i] = cli;
-      break;
-    }
-  }
-  clients_number++;
+/* Fill a configuration with the default settings */
+void config_defaults(config *cfg){
+  memset(cfg, 0, sizeof(config));
+  strcpy(cfg->bind_address, "0.0.0.0");
+  cfg->port = SERVER_PORT;
+  cfg->backlog = LISTEN_BACKLOG;
+  cfg->max_clients = MAX_CLIENT_NUMBER;
+  cfg->max_channels = MAX_CHANNEL_NUMBER;
+  cfg->max_users_by_channel = MAX_USER_BY_CHANNEL;
+  cfg->max_name_length = MAX_NAME_SIZE - 1;
+  cfg->buffer_size = BUFFER_SIZE;
+  cfg->queue_size = MAX_QUEUE_SIZE;
+  cfg->max_transfer_size = MAX_TRANSFER_SIZE;
+  cfg->accept_batch = ACCEPT_BATCH;
+  cfg->who_page_size = WHO_PAGE_SIZE;
+  cfg->handshake_timeout = HANDSHAKE_TIMEOUT;
+  cfg->idle_timeout = IDLE_TIMEOUT;
+  cfg->pong_timeout = PONG_TIMEOUT;
+  cfg->io_backend = IO_SPLICE;
+  cfg->presence_window = PRESENCE_WINDOW;
+  cfg->history_spill = 1;
+  cfg->history_retention = HISTORY_RETENTION;
+  cfg->shm_ring_size = SHM_RING_SIZE;
+  cfg->search_memory = SEARCH_MEMORY;
 }
 
-/* Remove a client from the client list and decrease the number of clients */
-void remove_client(client *cli){
-  int i;
-  int cli_id = cli->id;
-  for (i = 0; i < MAX_CLIENT_NUMBER; i++) {
-    if (clients[i]) {
-      if ((clients[i])->id == cli_id) {
-	clients[i] = NULL;
-	break;
-      }
+/* Parse value as the setting key of cfg. Return 0 on success, -1 if invalid */
+static int config_set(config *cfg, const config_key *key, char *value){
+  tenant_quota *quota;
+  char *end, extra;
+  long number;
+  void *field = (char *)cfg + key->offset;
+  switch (key->type){
+  case CONFIG_STRING:
+    if (strlen(value) >= INET_ADDRSTRLEN){
+      return -1;
+    }
+    strcpy((char *)field, value);
+    return 0;
+  case CONFIG_TEXT:
+    if (strlen(value) >= TEXT_SIZE){
+      return -1;
+    }
+    strcpy((char *)field, value);
+    return 0;
+  case CONFIG_TENANT:
+    quota = &cfg->tenants[cfg->tenant_count];
+    if (cfg->tenant_count == MAX_TENANTS ||
+	sscanf(value, "%31s %d %d %d %zu %c", quota->name, &quota->max_clients,
+	       &quota->max_channels, &quota->max_message_rate, &quota->max_memory, &extra) != 5 ||
+	quota->max_clients < 0 || quota->max_channels < 0 || quota->max_message_rate < 0){
+      return -1;
+    }
+    cfg->tenant_count++;
+    return 0;
+  case CONFIG_BACKEND:
+    if (!strcmp(value, "splice")){
+      *(int *)field = IO_SPLICE;
     }
+    else if (!strcmp(value, "copy")){
+      *(int *)field = IO_COPY;
+    }
+    else {
+      return -1;
+    }
+    return 0;
+  }
+  number = strtol(value, &end, 10);
+  if (end == value || *end || number < 0){
+    return -1;
   }
-  clients_number--;
+  if (key->type == CONFIG_SIZE){
+    *(size_t *)field = number;
+  }
+  else {
+    *(int *)field = number;
+  }
+  return 0;
 }
 
-/* Return a formatted list of users of the server */
-char* who_is_on_server(){
+/* Return the quotas of the tenant named name, NULL if it isn't declared */
+static tenant_quota *tenant_quota_of(config *cfg, const char *name){
   int i;
-  char *list = calloc(BUFFER_SIZE, 1);
-  char name[MAX_NAME_SIZE + 2];
-  for (i = 0; i < MAX_CLIENT_NUMBER ; i++){
-    if (clients[i]){
-      sprintf(name, "%s ", clients[i]->name);
-      strcat(list, name);
+  for (i = 0; i < cfg->tenant_count; i++){
+    if (!strcmp(cfg->tenants[i].name, name)){
+      return &cfg->tenants[i];
     }
   }
-  return list;
+  return NULL;
 }
 
-/* Find a channel in channels array given its name
-   Return the index where the channel is in the array, -1 if not found */
-int find_channel_by_name(char *chan_name){
-  int i;
-  for (i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-    if (channels[i]) {
-      if (!strcmp(channels[i]->name, chan_name)){
-	/* Debug */
-	/* printf("find channel by name = %d\n", i); */
-	/* printf("chan id %d\n", channels[i]->id); */
-	/* Return index if found */
-	return channels[i]->id;
-      }
+/* Return the quotas of a tenant. A tenant no longer declared since a
+   reload keeps its clients and gets the quotas of the default tenant */
+static tenant_quota *tenant_limits(config *cfg, tenant *t){
+  tenant_quota *quota = tenant_quota_of(cfg, t->name);
+  return quota ? quota : tenant_quota_of(cfg, "default");
+}
+
+/* Bring the settings of cfg back in the range the server can handle.
+   old is the configuration in use, NULL at startup */
+static void config_check(config *cfg, config *old){
+  const config_key *key;
+  tenant_quota *quota;
+  if (cfg->max_clients < 1) cfg->max_clients = 1;
+  if (cfg->max_channels < 1) cfg->max_channels = 1;
+  if (cfg->max_users_by_channel < 1) cfg->max_users_by_channel = 1;
+  if (cfg->max_name_length < 1 || cfg->max_name_length > MAX_NAME_SIZE - 1){
+    cfg->max_name_length = MAX_NAME_SIZE - 1;
+  }
+  /* The replies get buffer_size + BUFFER_SIZE bytes, the help alone takes over BUFFER_SIZE */
+  if (cfg->buffer_size < BUFFER_SIZE) cfg->buffer_size = BUFFER_SIZE;
+  if (cfg->queue_size < BUFFER_SIZE) cfg->queue_size = BUFFER_SIZE;
+  if (cfg->accept_batch < 1) cfg->accept_batch = 1;
+  if (cfg->who_page_size < 1) cfg->who_page_size = 1;
+  if (cfg->handshake_timeout < 1) cfg->handshake_timeout = 1;
+  if (cfg->idle_timeout < 1) cfg->idle_timeout = 1;
+  if (cfg->pong_timeout < 1) cfg->pong_timeout = 1;
+  if (cfg->presence_window < 0) cfg->presence_window = 0;
+  if (cfg->history_retention < 0) cfg->history_retention = 0;
+  /* The ring is indexed with a mask */
+  while (cfg->shm_ring_size & (cfg->shm_ring_size - 1)){
+    cfg->shm_ring_size &= cfg->shm_ring_size - 1;
+  }
+  if (cfg->shm_ring_size && cfg->shm_ring_size < BUFFER_SIZE) cfg->shm_ring_size = BUFFER_SIZE;
+  /* The default tenant has the limits of the server unless declared */
+  if (!tenant_quota_of(cfg, "default")){
+    quota = &cfg->tenants[cfg->tenant_count++];
+    strcpy(quota->name, "default");
+    quota->max_clients = cfg->max_clients;
+    quota->max_channels = cfg->max_channels;
+  }
+  if (!old){
+    return;
+  }
+  /* Keep what only matters at startup, and the limits within the arrays allocated then */
+  for (key = config_keys; key->key; key++){
+    if (!key->reloadable && memcmp((char *)cfg + key->offset, (char *)old + key->offset,
+				   key->type == CONFIG_STRING ? INET_ADDRSTRLEN :
+				   key->type == CONFIG_TEXT ? TEXT_SIZE :
+				   key->type == CONFIG_SIZE ? sizeof(size_t) : sizeof(int))){
+      printf("Setting %s can't change without a restart; ignored\n", key->key);
     }
   }
-  return -1;
+  strcpy(cfg->bind_address, old->bind_address);
+  cfg->port = old->port;
+  cfg->backlog = old->backlog;
+  cfg->thread_stack_size = old->thread_stack_size;
+  cfg->cpu_affinity = old->cpu_affinity;
+  strcpy(cfg->unix_path, old->unix_path);
+  if (cfg->max_clients > client_capacity){
+    printf("max_clients can't go over %d without a restart\n", client_capacity);
+    cfg->max_clients = client_capacity;
+  }
+  if (cfg->max_channels > channel_capacity){
+    printf("max_channels can't go over %d without a restart\n", channel_capacity);
+    cfg->max_channels = channel_capacity;
+  }
+  if (cfg->max_users_by_channel > user_capacity){
+    printf("max_users_by_channel can't go over %d without a restart\n", user_capacity);
+    cfg->max_users_by_channel = user_capacity;
+  }
 }
 
-/* Add a channel to the channels array
-   Return the index where it was added */
-int add_channel(char *chan_name){
-  int i;
-  channel *chan;
-    for (i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-      if (!channels[i]) {
-	chan = (channel *)calloc((sizeof(channel)),1);
-	strcpy(chan->name,chan_name);
-	chan->id = i;
-	chan->client_number = 0;
-	channels[i] = chan;
-	break;
-      }
+/* Read the configuration file path, made of "<key> <value>" lines and
+   '#' comments, and publish the new settings. Unknown keys and invalid
+   values are reported and ignored. Return 0 on success, -1 if the file
+   can't be read, in which case the settings in use are kept */
+int config_load(char *path){
+  config *cfg = malloc(sizeof(config)), *old = config_get();
+  retired_config *retired;
+  const config_key *key;
+  char line[BUFFER_SIZE], name[MAX_NAME_SIZE], value[BUFFER_SIZE];
+  int number = 0, fields;
+  size_t length;
+  FILE *file = NULL;
+
+  config_defaults(cfg);
+  if (path && !(file = fopen(path, "r"))){
+    perror("error: unable to read the configuration file");
+    free(cfg);
+    return -1;
+  }
+  while (file && fgets(line, sizeof(line), file)){
+    number++;
+    if ((fields = sscanf(line, " %31s %1023[^\n]", name, value)) < 1 || name[0] == '#'){
+      continue;
+    }
+    /* The value is the rest of the line, without the blanks ending it */
+    for (length = fields < 2 ? 0 : strlen(value); length && isspace(value[length - 1]); length--){
+      value[length - 1] = '\0';
+    }
+    for (key = config_keys; key->key && strcmp(key->key, name); key++);
+    if (!key->key){
+      printf("%s:%d: unknown setting %s\n", path, number, name);
     }
-    channels_number++;
-    return i;
+    else if (fields < 2 || config_set(cfg, key, value) < 0){
+      printf("%s:%d: invalid value for %s\n", path, number, name);
+    }
+  }
+  if (file){
+    fclose(file);
+  }
+  config_check(cfg, old);
+  __atomic_store_n(&current_config, cfg, __ATOMIC_SEQ_CST);
+  /* Threads may still be reading the old snapshot, it is freed once those
+     which entered before this point left */
+  if (old){
+    retired = malloc(sizeof(retired_config));
+    retired->cfg = old;
+    retired->epoch = __atomic_add_fetch(&config_epoch, 1, __ATOMIC_SEQ_CST);
+    retired->next = retired_configs;
+    retired_configs = retired;
+  }
+  return 0;
 }
 
-/* Removes a channel from the channels array, return the number of channels left */
-int remove_channel(int index){
-  free(channels[index]);
-  channels[index] = NULL;
-  channels_number--;
-  return channels_number;
+/* Convert seconds to ticks of the timer wheel */
+#define SECONDS_TO_TICKS(s) ((s) * 1000UL / TIMER_TICK)
+
+/* Return the current tick of the timer wheel */
+unsigned long timer_now(){
+  return __atomic_load_n(&wheel.now, __ATOMIC_RELAXED);
 }
 
-/* Say if a user (from his name) is on a chan given its position in channels array
-   Return 0 if the given user is on the chan, -1 otherwise */
-int is_user_on_channel(char *name, int chan_index){
-  int i;
-  channel *chan = channels[chan_index];
-  for (i = 0; i < MAX_USER_BY_CHANNEL ; i++){
-    if (chan->chan_clients[i]){
-      if (!strcmp(chan->chan_clients[i]->name, name)){
-	return 0;
-      }
-    }
-  }
-  return -1;
-}
-
-/* Add a client to a channel given its position in channels array.
-   Return the index of the client in the array, or -1 if the user is already on the channel*/
-int add_client_to_channel(client *cli, int chan_index){
-  int i, j;
-  channel *chan = channels[chan_index];
-  if (is_user_on_channel(cli->name, chan_index) < 0) {
-    for (i = 0; i < MAX_USER_BY_CHANNEL ; i++){
-      if (!chan->chan_clients[i]){
-	chan->chan_clients[i] = cli;
-	chan->client_number++;
-	for (j = 0; j < MAX_CHANNEL_NUMBER ; j++){
-	  if (!cli->sub_chan[j]){
-	    cli->sub_chan[j] = chan;
-	    break;
-	  }
-	}
-	return i;
-      }
-    }
-  }
-  return -1;
-}
-
-/* Remove a user (from his name) from a chan given its position in channels
-   Return the number of user left on the channel. */
-int remove_user_from_channel(char *name, int chan_index){
-  int i, j;
-  channel *chan = channels[chan_index];
-  for (i = 0; i < MAX_USER_BY_CHANNEL ; i++){
-    /* Debug */
-    /* if (chan->chan_clients[i]){ */
-    /*   printf("nom client : %s\n",chan->chan_clients[i]->name); */
-    /*   printf("nom donne: %s\n",name); */
-    /* } */
-    if (chan->chan_clients[i] && !strcmp(chan->chan_clients[i]->name, name)) {
-      for (j = 0; j < MAX_CHANNEL_NUMBER ; j++){
-	/* Debug */
-	/* if (chan->chan_clients[i]->sub_chan[j]){ */
-	/*     printf("chan : %s\n",chan->chan_clients[i]->sub_chan[j]->name); */
-	/*     printf("chan donne: %s\n",chan->name); */
-	/* } */
-	if (chan->chan_clients[i]->sub_chan[j] &&
-	    !strcmp(chan->chan_clients[i]->sub_chan[j]->name, chan->name)){
-	  chan->chan_clients[i]->sub_chan[j] = NULL;
-	}
-      }
-      chan->chan_clients[i] = NULL;
-      chan->client_number--;
-      break;
+/* Free the replaced configurations no reader can still use: those replaced
+   before the oldest epoch a reader entered with. Called by the main thread
+   on each tick */
+void config_reclaim(){
+  retired_config **link = &retired_configs, *retired;
+  unsigned long oldest = ULONG_MAX, epoch;
+  config_reader *r;
+  if (!retired_configs){
+    return;
+  }
+  pthread_mutex_lock(&config_readers_lock);
+  for (r = config_readers; r; r = r->next){
+    if ((epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) && epoch < oldest){
+      oldest = epoch;
     }
   }
-  if (chan->client_number == 0){
-    remove_channel(chan_index);
+  pthread_mutex_unlock(&config_readers_lock);
+  /* Newest first: once one is old enough, the rest are too */
+  while (*link && (*link)->epoch > oldest){
+    link = &(*link)->next;
+  }
+  while ((retired = *link)){
+    *link = retired->next;
+    free(retired->cfg);
+    free(retired);
   }
-  return chan->client_number;
 }
 
+/* Put a timer in the slot matching its expiration. wheel.lock must be held */
+static void timer_insert(timer *t){
+  unsigned long delta;
+  int level = 0, slot;
+  timer **head;
+  if (t->expires <= wheel.now){
+    t->expires = wheel.now + 1;
+  }
+  delta = t->expires - wheel.now;
+  while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))){
+    level++;
+  }
+  /* Past the last level, wait in its furthest slot and get cascaded again */
+  if (delta >= (1UL << (WHEEL_BITS * WHEEL_LEVELS))){
+    t->expires = wheel.now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  }
+  slot = (t->expires >> (WHEEL_BITS * level)) & ((1 << WHEEL_BITS) - 1);
+  head = &wheel.slots[level][slot];
+  if ((t->next = *head)){
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+}
 
-/* Return a formatted list of users of a channel given its position in channels */
-char* who_is_on_channel(int chan_index){
-  int i;
-  channel *chan = channels[chan_index];
-  char *list = calloc(BUFFER_SIZE, 1);
-  char name[MAX_NAME_SIZE + 2];
-  for (i = 0; i < MAX_USER_BY_CHANNEL ; i++){
-    if (chan->chan_clients[i]){
-      sprintf(name, "%s ", chan->chan_clients[i]->name);
-      strcat(list, name);
+/* Unlink a timer from its slot. wheel.lock must be held */
+static void timer_unlink(timer *t){
+  if (t->pprev){
+    if ((*t->pprev = t->next)){
+      t->next->pprev = t->pprev;
     }
+    t->pprev = NULL;
+    t->next = NULL;
   }
-  return list;
 }
 
-/* Handle the client thread */
-void *client_loop(void *arg){
-  char *buffer = calloc(BUFFER_SIZE, 1); /* message received */
-  int length, /* length of the message*/
-    cli_co, /* socket_descriptor of the client */
-    index,
-    answer;
-  char out[BUFFER_SIZE]; /* message that will be sent */
-  char *cmd, /* command received */
-    *name, /* name received */
-    *args; /* arguments received */
-
-  /* Make proper use of the arg received */
-  client *cli = (client *)arg;
+/* Arm (or re-arm) a timer to fire ticks ticks from now, callbacks included */
+void timer_arm(timer *t, unsigned long ticks){
+  pthread_mutex_lock(&wheel.lock);
+  timer_unlink(t);
+  t->expires = wheel.now + ticks;
+  timer_insert(t);
+  pthread_mutex_unlock(&wheel.lock);
+}
 
-  /* Greet the client */
+/* Cancel a timer. Once it returns, the callback of the timer isn't running
+   and didn't re-arm it. Not to be called by the callback of the timer */
+void timer_cancel(timer *t){
+  pthread_mutex_lock(&wheel.lock);
+  timer_unlink(t);
+  while (wheel.running == t){
+    pthread_cond_wait(&wheel.idle, &wheel.lock);
+    timer_unlink(t);
+  }
+  pthread_mutex_unlock(&wheel.lock);
+}
 
-  sprintf(out, "%d has joined the chat.\n", cli->id);
-  send_message_to_all(out);
-  sprintf(out, "Type /help for help.\n");
-  send_message_to_client(out, cli->cli_co);
+/* Move the timers of a slot of an upper level to the levels below */
+static void timer_cascade(int level){
+  int slot = (wheel.now >> (WHEEL_BITS * level)) & ((1 << WHEEL_BITS) - 1);
+  timer *t = wheel.slots[level][slot], *next;
+  wheel.slots[level][slot] = NULL;
+  for (; t; t = next){
+    next = t->next;
+    t->pprev = NULL;
+    timer_insert(t);
+  }
+}
 
-  /* Handle the reception of a message */
-  /* read is blocking ; so we enter the loop only if a message is received */
-  while ((length = read(cli->cli_co, buffer, BUFFER_SIZE)) > 0){
-    /* Add an end to the buffer */
-    buffer[length] = '\0';
-    /* Handle the reception of a command */
-    if (buffer[0] == '/'){
-      /* strtok splits string into tokens*/
-      cmd = strtok(buffer, " \n");
-      /* Check which command it is */
-      /* Command: /nick <name> */
-      if (!strcmp(cmd, "/nick")){
-	/* strtok documentation : Alternativelly, a null pointer may be specified, in which case the function continues scanning where a previous successful call to the function ended. */
-	name = strtok(NULL, " \n\t");
-	/* test if name is NULL, so no name was given */
-	if (name){
-	  /* Check if the name is not already used */
-	  if (find_client_by_name(name) < 0){
-	    sprintf(out, "%s renamed to %s.\n", cli->name, name);
-	    strcpy(cli->name, name);
-	    send_message_to_all(out);
-	  }
-	  else {
-	    sprintf(out, "%s is already in use.\n", name);
-	    send_message_to_client(out, cli->cli_co);
-	  }
-	}
-	else {
-	  send_message_to_client("You must enter a name.\n", cli->cli_co);
-	}
-      }
-      /* Command: /me <action> */
-      else if (!strcmp(cmd, "/me")){
-	args = strtok(NULL, "\0");
-	if (args){
-	  sprintf(out, "%s %s", cli->name, args);
-	  send_message_to_all(out);
-	}
-	else {
-	  send_message_to_client("You must enter an action.\n", cli->cli_co);
-	}
-      }
-      /* Command: /pm <name> <private-message */
-      else if (!strcmp(cmd, "/pm")) {
-	name = strtok(NULL, " ");
-	/* Check if name exists in the client list */
-	if ((cli_co = find_client_by_name(name)) < 0){
-	  sprintf(out, "%s is already taken.\n", name);
-	}
-	/* Send the private message to both sender and receiver */
-	else {
-	  args = strtok(NULL, "\0");
-	  if (args){
-	    sprintf(out, "%s sends to you: %s", cli->name, args);
-	    send_message_to_client(out, cli_co);
-	    sprintf(out, "You sent to %s: %s", name, args);
-	  }
-	  else {
-	    sprintf(out, "You must enter a message.\n");
-	  }
-	}
-	send_message_to_client(out, cli->cli_co);
-      }
-      /* Command: /join <channel-name> */
-      else if (!strcmp(cmd, "/join")) {
-	  name = strtok(NULL, " \n\t");
-	  if (name){
-	    /* Add the client to the defined channel if it already exists */
-	    if ((index = find_channel_by_name(name)) >= 0) {
-	      if (channels[index]->client_number < MAX_USER_BY_CHANNEL){
-		if (add_client_to_channel(cli, index) < 0){
-		  sprintf(out, "You are already on chan %s.\n", name);
-		}
-		else {
-		  sprintf(out, "%s had joined channel %s.\n", cli->name, name);
-		  send_message_to_channel(out, index);
-		sprintf(out, "Welcome to channel %s. You are the n°%d arrived on this channel.\n", name, channels[index]->client_number);
-		}
-	      }
-	      else {
-		sprintf(out, "Too many users on this channel already.\n");
-	      }
-	    }
-	    /* if the channel doesn't exists, create it */
-	    /* check if there are already too many channels */
-	    else if (channels_number < MAX_CHANNEL_NUMBER){
-	      /* Add the client to the newly created channel */
-	      index = add_channel(name);
-	      add_client_to_channel(cli, index);
-	      sprintf(out, "Welcome to channel %s. You are the n°%d arrived on this channel.\n", name, channels[index]->client_number);
-	    }
-	    else {
-	      sprintf(out, "Too many channels already.\n");
-	    }
-	  }
-	  else {
-	    sprintf(out, "You must enter a channel name.\n");
-	  }
-	  send_message_to_client(out, cli->cli_co);
-      }
-      /* Command: /tell <channel-name> <message> */
-      else if (!strcmp(cmd, "/tell")) {
-	  name = strtok(NULL, " \n\t");
-	  args = strtok(NULL, "\0");
-	  /* If there is a message */
-	  if (args){
-	    if (name){
-	      /* Send message if the given name is a channel */
-	      if ((index = find_channel_by_name(name)) >= 0) {
-		sprintf(out, "%s said on %s: %s", cli->name, name, args);
-		send_message_to_channel(out, index);
-	      }
-	      /* Send message to server if name is global */
-	      else if (!strcmp(name, "global")){
-		sprintf(out, "%s said : %s", cli->name, args);
-		send_message_to_all(out);
-	      }
-	      else {
-		sprintf(out, "Channel %s doesn't exist. Create it first with /join %s.\n", name, name);
-		send_message_to_client(out, cli->cli_co);
-	      }
-	    }
-	    else {
-	      sprintf(out, "You must enter a channel name.\n");
-	      send_message_to_client(out, cli->cli_co);
-	    }
-	  }
-	  else {
-	    sprintf(out, "You must enter a message.\n");
-	    send_message_to_client(out, cli->cli_co);
-	  }
-      }
-      /* Command: /leave <channel-name> */
-      else if (!strcmp(cmd, "/leave")) {
-	name = strtok(NULL, " \n\t");
-	if (name){
-	  /* Get the index of the chan given */
-	  index = find_channel_by_name(name);
-	  if (index < 0){
-	    sprintf(out, "Chan %s doesn't exist.\n", name);
-	    send_message_to_client(out, cli->cli_co);
-	  }
-	  /* Remove the user only if he is already on channel */
-	  else if (is_user_on_channel(cli->name, index) == 0) {
-	    answer = remove_user_from_channel(cli->name, index);
-	    sprintf(out, "Left channel: %s. \n", name);
-	    send_message_to_client(out, cli->cli_co);
-	    if (answer != 0){
-	      sprintf(out, "%s left channel %s.\n", cli->name, name);
-	      send_message_to_channel(out, index);
-	    }
-	  }
-	  else {
-	    sprintf(out, "You are not on channel %s", name);
-	    send_message_to_client(out, cli->cli_co);
-	  }
-	}
-      }
-      /* Command: /who <channel> */
-      else if (!strcmp(cmd, "/who")) {
-	args = strtok(NULL, " \n\t");
-	if (args){
-	  /* If global, list the users on the server */
-	  if (!strcmp(args, "global")){
-	    name = who_is_on_server();
-	    sprintf(out, "Users on the server: %s\n", name);
-	    free(name);
-	  }
-	  /* If not and the args are a channel-name, list the users on the channel */
-	  else if ((index = find_channel_by_name(args)) >= 0){
-	    name = who_is_on_channel(index);
-	    sprintf(out, "Users on channel %s: %s\n", args, name);
-	    free(name);
-	  }
-	  else {
-	    sprintf(out, "No channel named %s.\n", args);
-	  }
-	}
-	else {
-	  sprintf(out, "You need to enter a channel name.\n");
-	}
-	send_message_to_client(out, cli->cli_co);
-      }
-      /* Command: /howmany <channel> */
-      else if (!strcmp(cmd, "/howmany")) {
-	args = strtok(NULL, " \n\t");
-      	if (args){
-	  /* If global, return the number of users on the server */
-	  if (!strcmp(args, "global")){
-	    sprintf(out, "Users on the server: %d on %d users authorized.\n",
-		    clients_number, MAX_CLIENT_NUMBER);
-	  }
-	  /* If channels, return the number of channels used */
-	  else if (!strcmp(args, "channels")){
-	    sprintf(out, "%d channels out of %d available", channels_number, MAX_CHANNEL_NUMBER);
-	  }
-	  /* If not and the args are a channel-name, return the number of users on the channel */
-	  else if ((index = find_channel_by_name(args)) >= 0){
-	    sprintf(out, "Users on channel %s : %d on %d users authorized.\n",
-		    channels[index]->name, channels[index]->client_number, MAX_USER_BY_CHANNEL);
-	  }
-	  else {
-	    sprintf(out, "No channel named %s.\n", args);
-	  }
-	}
-	else {
-	  sprintf(out, "You need to enter a channel name.\n");
-	}
-	send_message_to_client(out, cli->cli_co);
-      }
-      /* Command: /quit */
-      else if (!strcmp(cmd, "/quit")) {
+/* Advance the wheel up to the tick now, firing the timers expired on the way.
+   Each callback runs after its timer is taken off the wheel and the lock is
+   released, so a slow one delays the other timers, never their arming */
+void timer_advance(unsigned long now){
+  int level, slot;
+  timer *t;
+  pthread_mutex_lock(&wheel.lock);
+  while (wheel.now < now){
+    __atomic_store_n(&wheel.now, wheel.now + 1, __ATOMIC_RELAXED);
+    /* When a level wraps, bring the next slot of the level above down */
+    for (level = 1; level < WHEEL_LEVELS; level++){
+      if (wheel.now & ((1UL << (WHEEL_BITS * level)) - 1)){
 	break;
       }
-      /* Command: /help or not recognized command */
-      else {
-	sprintf(out, "\n");
-	if (strcmp(cmd, "/help")){
-	  strcat(out, "Unrecognized command.\n");
-	}
-	strcat(out, "/nick <name>\tChange your username to <name>.\n");
-	strcat(out, "/me <action>\tSend the <action> to all.\n");
-	strcat(out, "/pm <name> <private-message>\tSend <private-message> to <name>.\n");
-	strcat(out, "/join <channel-name>\tJoin or create channel <channel-name>.\n");
-	strcat(out, "/tell <channel-name> <message>\tSend a message to a previously created channel.\n");
-	strcat(out, "/leave <channel-name>\tLeave channel <channel-name>.\n");
-	strcat(out, "/who <channel>\tList the users on <channel>. Use 'global' for server.\n");
-	strcat(out, "/howmany <channel>\tCounts the users on <channel>. Use 'global' for server.\n");
-	strcat(out, "/quit\tQuit the client.\n");
-	strcat(out, "/help\tPrint this message.\n");
-	send_message_to_client(out, cli->cli_co);
-      }
-    }
-    /* Message is not a command */
-    else {
-      sprintf(out, "%s says : %s", cli->name, buffer);
-      send_message_to_all(out);
+      timer_cascade(level);
     }
-  }
-
-  /* Client quit/disconnected */
-
-  /* Notify the clients */
-  sprintf(out, "%s has left the chat.\n", cli->name);
-  send_message_to_all(out);
-
-  /* Handle the proper closing of the thread */
-  for(index = 0; index < MAX_CHANNEL_NUMBER; index++) {
-    if (cli->sub_chan[index]) {
-      answer = find_channel_by_name(cli->sub_chan[index]->name);
-      remove_user_from_channel(cli->name, answer);
+    slot = wheel.now & ((1 << WHEEL_BITS) - 1);
+    while ((t = wheel.slots[0][slot])){
+      timer_unlink(t);
+      wheel.running = t;
+      pthread_mutex_unlock(&wheel.lock);
+      t->callback(t);
+      pthread_mutex_lock(&wheel.lock);
+      wheel.running = NULL;
+      pthread_cond_broadcast(&wheel.idle);
     }
   }
-
-  close(cli->cli_co);
-  remove_client(cli);
-  free(cli);
-  free(buffer);
-  pthread_detach(pthread_self());
-  return NULL;
+  pthread_mutex_unlock(&wheel.lock);
 }
 
-/*--------- Main ---------*/
+/* Return the number of ticks elapsed since the server started, from the coarse clock */
+unsigned long clock_ticks(){
+  static struct timespec start;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  if (!start.tv_sec && !start.tv_nsec){
+    start = now;
+  }
+  return ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000)
+    / TIMER_TICK;
+}
 
-int main(int argc, char **argv) {
-  int new_socket_descriptor,  /* new socket descriptor */
-    address_length; /* client address length */
-  sockaddr_in local_address,    /* local address socket informations */
-    cli_addr;  /* client address */
-  hostent* ptr_host;  /* informations about host */
-  char host_name[MAX_NAME_SIZE+1];  /* host name */
-  pthread_t thread; /* thread to handle client */
-  client *cli; /* client structure */
+/* FNV-1a hash of a string */
+static unsigned int hash_string(const char *s){
+  unsigned int h = 2166136261u;
+  while (*s){
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  }
+  return h;
+}
 
-  /* Handle SIGPIPE signal */
-  signal(SIGPIPE, signal_handler);
-  signal(SIGINT, signal_handler);
+/* Next entry of the bucket of entry in index */
+#define INDEX_NEXT(index, entry) (*(void **)((char *)(entry) + (index)->link))
 
-  gethostname(host_name,MAX_NAME_SIZE);  /* getting host name */
+/* Start an empty index of entries whose next entry and name are at link and name */
+void name_index_init(name_index *index, size_t link, size_t name){
+  memset(index, 0, sizeof(name_index));
+  index->link = link;
+  index->name = name;
+}
 
-  /* get hostent using server name */
-  if ((ptr_host = gethostbyname(host_name)) == NULL) {
-    perror("error: unable to find server using its name.");
-    exit(1);
+/* Return the entry of index named name, NULL if there is none */
+void *name_index_find(name_index *index, const char *name){
+  void *entry = NULL;
+  if (index->size){
+    entry = index->buckets[hash_string(name) & (index->size - 1)];
   }
-  /* printf("ptr host\n"); */
-  /* printf("h_name %s \n",ptr_host->h_name); */
-  /* printf("h_addrtype %d \n",ptr_host->h_addrtype); */
-  /* printf("h_length %d \n",ptr_host->h_length); */
-  /* printf("h_addr_list %s \n",ptr_host->h_addr); */
-  /* initialize sockaddr_in with these informations */
-  bcopy((char*)ptr_host->h_addr, (char*)&local_address.sin_addr, ptr_host->h_length);
-  local_address.sin_family = ptr_host->h_addrtype;
-  /* AF_INET */
-  local_address.sin_addr.s_addr = INADDR_ANY;
-  /* use the defined port */
-  local_address.sin_port = htons(SERVER_PORT);
-  printf("Using port : %d \n", ntohs(local_address.sin_port));
-  /* create socket in socket_descriptor */
-  if ((socket_descriptor = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("error: unable to create the connection socket.");
-    exit(1);
-  }
-  /* bind socket socket_descriptor to sockaddr_in local_address */
-  if ((bind(socket_descriptor, (sockaddr*)(&local_address), sizeof(local_address))) < 0) {
-    perror("error: unable to bind the socket to the connection address.");
-    exit(1);
+  while (entry && strcmp((char *)entry + index->name, name)){
+    entry = INDEX_NEXT(index, entry);
   }
-  /* initialize the queue */
-  listen(socket_descriptor,MAX_CLIENT_NUMBER);
+  return entry;
+}
 
+/* Put entry in its bucket */
+static void name_index_link(name_index *index, void *entry){
+  void **bucket = &index->buckets[hash_string((char *)entry + index->name) & (index->size - 1)];
+  INDEX_NEXT(index, entry) = *bucket;
+  *bucket = entry;
+}
 
-  for(;;) {
-    address_length = sizeof(cli_addr);
-    /* cli_addr given by accept with connect informations*/
-    if ((new_socket_descriptor =
-	 accept(socket_descriptor,
-		(sockaddr*)(&cli_addr),
-		&address_length)
-	 ) < 0) {
-      perror("error: unable to accept connection to the client.");
-      exit(1);
+/* Add entry to index, under its current name */
+void name_index_add(name_index *index, void *entry){
+  void **old = index->buckets, *moved, *next;
+  unsigned int i, size = index->size;
+  if (index->count >= size){
+    index->size = size ? 2 * size : 16;
+    index->buckets = calloc(index->size, sizeof(void *));
+    for (i = 0; i < size; i++){
+      for (moved = old[i]; moved; moved = next){
+	next = INDEX_NEXT(index, moved);
+	name_index_link(index, moved);
+      }
     }
+    free(old);
+  }
+  name_index_link(index, entry);
+  index->count++;
+}
 
-    /* check if there are already too many clients */
-    if ( (clients_number) >= MAX_CLIENT_NUMBER){
-      printf("Too many clients already; client rejected\n");
-      send_message_to_client("Too many clients, try again later.\n", new_socket_descriptor);
-      close(new_socket_descriptor);
-      continue;
-    }
+/* Take entry, added under its current name, off index */
+void name_index_remove(name_index *index, void *entry){
+  void **link = &index->buckets[hash_string((char *)entry + index->name) & (index->size - 1)];
+  while (*link != entry){
+    link = &INDEX_NEXT(index, *link);
+  }
+  *link = INDEX_NEXT(index, entry);
+  index->count--;
+}
 
-    /* Client settings and handling */
-    cli = (client *)calloc((sizeof(client)), 1);
-    cli->addr = cli_addr;
-    cli->cli_co = new_socket_descriptor;
-    cli->id = id++;
-    sprintf(cli->name, "%d", cli->id);
-    printf("Client connected, using the id: %d\n", cli->id);
+/* Add cli to a list of members, slot is where cli keeps its position */
+void member_list_add(member_list *list, client *cli, int *slot){
+  if (list->count == list->capacity){
+    list->capacity = list->capacity ? 2 * list->capacity : 16;
+    list->clients = realloc(list->clients, list->capacity * sizeof(client *));
+    list->names = realloc(list->names, list->capacity * sizeof(*list->names));
+    list->slots = realloc(list->slots, list->capacity * sizeof(int *));
+  }
+  *slot = list->count++;
+  list->clients[*slot] = cli;
+  strcpy(list->names[*slot], cli->name);
+  list->slots[*slot] = slot;
+}
 
-    add_client(cli);
-    pthread_create(&thread, NULL, client_loop, (void *)cli);
+/* Take the member at *slot off a list: the last member moves to its place */
+void member_list_remove(member_list *list, int *slot){
+  int last = --list->count;
+  if (*slot != last){
+    list->clients[*slot] = list->clients[last];
+    memcpy(list->names[*slot], list->names[last], MAX_NAME_SIZE);
+    list->slots[*slot] = list->slots[last];
+    *list->slots[*slot] = *slot;
+  }
+}
+
+/* Release the memory used by a list of members */
+void member_list_free(member_list *list){
+  free(list->clients);
+  free(list->names);
+  free(list->slots);
+  memset(list, 0, sizeof(member_list));
+}
+
+/* Copy the names offset to offset+limit of a list, each one followed by a
+   space. total is set to the number of names in the list */
+static char* member_list_page(member_list *list, int offset, int limit, int *total){
+  char *page, *end;
+  size_t length;
+  int i;
+  *total = list->count;
+  if (offset > list->count){
+    offset = list->count;
+  }
+  if (limit > list->count - offset){
+    limit = list->count - offset;
+  }
+  end = page = malloc((size_t)limit * MAX_NAME_SIZE + 1);
+  for (i = offset; i < offset + limit; i++){
+    length = strlen(list->names[i]);
+    memcpy(end, list->names[i], length);
+    end[length] = ' ';
+    end += length + 1;
+  }
+  *end = '\0';
+  return page;
+}
+
+/* Create a message holding a copy of msg, with no reference yet */
+message *message_create(char *msg){
+  size_t length = strlen(msg) + 1;
+  message *m = malloc(sizeof(message) + length);
+  m->refs = 0;
+  m->length = length;
+  memcpy(m->data, msg, length);
+  return m;
+}
+
+/* Drop a reference to a message, freeing it when nobody holds it */
+void message_release(message *m){
+  if (__sync_sub_and_fetch(&m->refs, 1) == 0){
+    free(m);
+  }
+}
+
+/* Drop a reference to a history, it is freed by history_sweep once unused
+   for history_retention */
+void history_release(history *h){
+  __atomic_store_n(&h->released, timer_now(), __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Empty the queue without sending anything. q->lock must be held */
+static void outqueue_drop_all(outqueue *q){
+  int prio;
+  queued *node;
+  for (prio = 0; prio < PRIO_CLASSES; prio++){
+    while ((node = q->head[prio])){
+      q->head[prio] = node->next;
+      message_release(node->msg);
+      free(node);
+    }
+    q->tail[prio] = NULL;
+  }
+  if (q->charged){
+    __atomic_fetch_sub(q->charged, q->bytes, __ATOMIC_RELAXED);
+  }
+  q->bytes = 0;
+}
+
+/* Add a message to the outbound queue of a client with the priority prio.
+   Bulk messages are dropped when the queue is full or when the tenant of
+   the client is over its memory, replies never are: a client that lets
+   CONTROL_BACKLOG queues of them pile up is disconnected instead.
+   Return 0 if queued, -1 if dropped */
+int outqueue_push(client *cli, message *m, int prio){
+  outqueue *q = &cli->out;
+  size_t queue_size = config_get()->queue_size;
+  queued *node;
+  pthread_mutex_lock(&q->lock);
+  if (prio == PRIO_CONTROL && !q->dead && !q->closing &&
+      q->bytes + m->length > CONTROL_BACKLOG * queue_size){
+    printf("Client %d doesn't read its replies; client dropped\n", cli->id);
+    q->dead = 1;
+    outqueue_drop_all(q);
+    /* Wakes up the reader thread, which then removes the client */
+    shutdown(cli->cli_co, SHUT_RDWR);
+  }
+  if (q->dead || q->closing ||
+      (prio != PRIO_CONTROL && (q->bytes + m->length > queue_size ||
+				(q->tenant && __atomic_load_n(&q->tenant->over_memory,
+							      __ATOMIC_RELAXED))))){
+    q->dropped++;
+    pthread_mutex_unlock(&q->lock);
+    return -1;
+  }
+  node = malloc(sizeof(queued));
+  __sync_fetch_and_add(&m->refs, 1);
+  node->msg = m;
+  node->next = NULL;
+  if (q->tail[prio]){
+    q->tail[prio]->next = node;
+  }
+  else {
+    q->head[prio] = node;
+  }
+  q->tail[prio] = node;
+  q->bytes += m->length;
+  if (q->charged){
+    __atomic_fetch_add(q->charged, m->length, __ATOMIC_RELAXED);
+  }
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+/* Charge the tenant t for the bytes queued for cli, and for those queued
+   from now on. Runs with the lock of t held */
+void outqueue_charge(client *cli, tenant *t){
+  outqueue *q = &cli->out;
+  pthread_mutex_lock(&q->lock);
+  q->tenant = t;
+  q->charged = &t->shards[cli->id % TENANT_SHARDS].memory;
+  __atomic_fetch_add(q->charged, q->bytes, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Move to the next class in the round of the writer */
+static void outqueue_next_class(outqueue *q){
+  q->current = (q->current + 1) % PRIO_CLASSES;
+  q->granted = 0;
+}
+
+/* Take at most max messages out of the queue, by deficit round-robin:
+   each round visits the classes from the most urgent one and lets each
+   of them send up to its quantum, so bulk traffic delays replies by one
+   round at most and still gets its share. q->lock must be held */
+static int outqueue_pick(outqueue *q, message **batch, int max){
+  int n = 0, prio;
+  size_t bytes = q->bytes;
+  queued *node;
+  while (n < max && q->bytes){
+    prio = q->current;
+    if (!(node = q->head[prio])){
+      q->deficit[prio] = 0;
+      outqueue_next_class(q);
+      continue;
+    }
+    if (!q->granted){
+      q->deficit[prio] += prio_quantum[prio];
+      q->granted = 1;
+    }
+    if (node->msg->length > q->deficit[prio]){
+      outqueue_next_class(q);
+      continue;
+    }
+    q->deficit[prio] -= node->msg->length;
+    q->bytes -= node->msg->length;
+    if (!(q->head[prio] = node->next)){
+      q->tail[prio] = NULL;
+    }
+    batch[n++] = node->msg;
+    free(node);
+  }
+  if (q->charged){
+    __atomic_fetch_sub(q->charged, bytes - q->bytes, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+/* Write count messages in one go, retrying on partial writes.
+   Return 0 on success, -1 on error */
+static int write_batch(int fd, message **batch, int count){
+  struct iovec iov[WRITE_BATCH];
+  struct msghdr hdr;
+  int i, first = 0;
+  ssize_t written;
+  for (i = 0; i < count; i++){
+    iov[i].iov_base = batch[i]->data;
+    iov[i].iov_len = batch[i]->length;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  while (first < count){
+    hdr.msg_iov = iov + first;
+    hdr.msg_iovlen = count - first;
+    /* MSG_NOSIGNAL: a closed connection must not raise SIGPIPE */
+    if ((written = sendmsg(fd, &hdr, MSG_NOSIGNAL)) < 0){
+      return -1;
+    }
+    while (first < count && written >= (ssize_t)iov[first].iov_len){
+      written -= iov[first].iov_len;
+      first++;
+    }
+    if (first < count){
+      iov[first].iov_base = (char *)iov[first].iov_base + written;
+      iov[first].iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+/* Pin a thread to a CPU, nothing is done if cpu is -1 */
+void pin_thread(pthread_t thread, int cpu){
+  cpu_set_t set;
+  if (cpu < 0){
+    return;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(thread, sizeof(set), &set)){
+    fprintf(stderr, "error: unable to pin a thread to CPU %d\n", cpu);
+  }
+}
+
+/* Handle the writer thread of a client: flush its queue until it leaves */
+void *writer_loop(void *arg){
+  client *cli = (client *)arg;
+  outqueue *q = &cli->out;
+  message *batch[WRITE_BATCH];
+  int i, count, failed;
+  pin_thread(pthread_self(), cli->cpu);
+  pthread_mutex_lock(&q->lock);
+  for (;;){
+    while (!q->bytes && !q->closing){
+      pthread_cond_wait(&q->ready, &q->lock);
+    }
+    /* Leave once everything queued before closing is sent */
+    if (!q->bytes){
+      break;
+    }
+    count = outqueue_pick(q, batch, WRITE_BATCH);
+    pthread_mutex_unlock(&q->lock);
+    /* A /send relayed to the client writes its chunks under write_lock too */
+    pthread_mutex_lock(&q->write_lock);
+    failed = write_batch(cli->cli_co, batch, count);
+    pthread_mutex_unlock(&q->write_lock);
+    for (i = 0; i < count; i++){
+      message_release(batch[i]);
+    }
+    pthread_mutex_lock(&q->lock);
+    q->flushes++;
+    pthread_cond_broadcast(&q->flushed);
+    if (failed){
+      perror("error: failing to send message to client");
+      q->dead = 1;
+      outqueue_drop_all(q);
+      break;
+    }
+  }
+  pthread_cond_broadcast(&q->flushed);
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+/* Initialize the outbound queue of a client and start its writer thread */
+void outqueue_start(client *cli){
+  outqueue *q = &cli->out;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->ready, NULL);
+  pthread_mutex_init(&q->write_lock, NULL);
+  pthread_cond_init(&q->flushed, NULL);
+  pthread_create(&q->writer, &thread_attr, writer_loop, (void *)cli);
+}
+
+/* Flush what is left in the queue of a client and stop its writer thread */
+void outqueue_stop(client *cli){
+  outqueue *q = &cli->out;
+  pthread_mutex_lock(&q->lock);
+  q->closing = 1;
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+  pthread_join(q->writer, NULL);
+  /* Wait for the /send relayed to the client to notice it left */
+  pthread_mutex_lock(&q->lock);
+  while (q->transfers){
+    pthread_cond_wait(&q->flushed, &q->lock);
+  }
+  pthread_mutex_unlock(&q->lock);
+  outqueue_drop_all(q);
+  pthread_cond_destroy(&q->flushed);
+  pthread_mutex_destroy(&q->write_lock);
+  pthread_cond_destroy(&q->ready);
+  pthread_mutex_destroy(&q->lock);
+}
+
+/* Send a message to all clients of the tenant t */
+void send_message_to_all(tenant *t, char *msg){
+  int i;
+  message *m = message_create(msg);
+  /* Hold a reference while queuing so m outlives the fastest writer */
+  m->refs = 1;
+  pthread_mutex_lock(&t->lock);
+  for (i = 0; i < t->members.count; i++) {
+    ops->deliver(t->members.clients[i], m, PRIO_CHANNEL);
+  }
+  pthread_mutex_unlock(&t->lock);
+  message_release(m);
+}
+
+/* Send a message to a client with the priority prio */
+void send_message_to_client(char *msg, client *cli, int prio){
+  message *m = message_create(msg);
+  m->refs = 1;
+  ops->deliver(cli, m, prio);
+  message_release(m);
+}
+
+/* Send a message to the client of the tenant t named name with the priority prio.
+   Return 0 if sent, -1 if there is no such client */
+int send_message_to_name(tenant *t, char *msg, char *name, int prio){
+  client *cli;
+  int found = -1;
+  pthread_mutex_lock(&t->lock);
+  if ((cli = name_index_find(&t->users, name))){
+    send_message_to_client(msg, cli, prio);
+    found = 0;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return found;
+}
+
+/* Send a long reply to a client,
+   split in chunks of BUFFER_SIZE at most, cutting on spaces when possible */
+void send_long_message_to_client(char *msg, client *cli){
+  char chunk[BUFFER_SIZE];
+  size_t length = strlen(msg), size;
+  while (length > 0){
+    size = length;
+    if (size > BUFFER_SIZE - 1){
+      size = BUFFER_SIZE - 1;
+      while (size > 1 && msg[size - 1] != ' '){
+	size--;
+      }
+      if (size == 1){
+	size = BUFFER_SIZE - 1;
+      }
+    }
+    memcpy(chunk, msg, size);
+    chunk[size] = '\0';
+    send_message_to_client(chunk, cli, PRIO_CONTROL);
+    msg += size;
+    length -= size;
+  }
+}
+
+/* Handle the expiration of the keepalive timer of a client:
+   enforce the handshake deadline, PING idle clients and drop those
+   not answering. Runs on the thread advancing the wheel */
+void keepalive_expired(timer *t){
+  client *cli = (client *)((char *)t - offsetof(client, keepalive));
+  unsigned long last_seen = __atomic_load_n(&cli->last_seen, __ATOMIC_RELAXED);
+  long idle = (long)(timer_now() - last_seen); /* ticks since the last message */
+  config *cfg = config_get();
+  if (!last_seen){
+    printf("Client %d didn't identify itself in time; client dropped\n", cli->id);
+  }
+  /* The client spoke since the timer was armed, wait for the rest of the delay */
+  else if (idle < (long)SECONDS_TO_TICKS(cfg->idle_timeout)){
+    cli->pinged = 0;
+    timer_arm(t, SECONDS_TO_TICKS(cfg->idle_timeout) - idle);
+    return;
+  }
+  else if (!cli->pinged){
+    cli->pinged = 1;
+    send_message_to_client(CONTROL_MARK "PING\n", cli, PRIO_CONTROL);
+    timer_arm(t, SECONDS_TO_TICKS(cfg->pong_timeout));
+    return;
+  }
+  else {
+    printf("Client %d didn't answer PING; client dropped\n", cli->id);
+  }
+  ops->disconnect(cli);
+}
+
+/* Find a client of the tenant t using the name given,
+return client cli_co if found
+or -1 if name is not found */
+int find_client_by_name(tenant *t, char *name){
+  client *cli;
+  int found = -1;
+  pthread_mutex_lock(&t->lock);
+  if ((cli = name_index_find(&t->users, name))){
+    found = cli->cli_co;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return found;
+}
+
+/* Enable the handling of signals. Only calls what is safe in a handler:
+   the locks may be held by the interrupted thread, so the registry is
+   walked without them, the process exits right after */
+void signal_handler(int signal_number){
+  int i;
+  client *cli;
+  /* SIGHUP asks for the configuration to be read again, by the main loop */
+  if (signal_number == SIGHUP) {
+    reload_requested = 1;
+    return;
+  }
+  write(STDOUT_FILENO, "Received signal: Interrupt\n", 27);
+  /* Warn the clients that the server is closing */
+  if (signal_number == SIGINT) {
+    for (i = 0; i < CLIENT_SHARDS; i++) {
+      for (cli = client_shards[i].first; cli; cli = cli->shard_next) {
+	write(cli->cli_co, "Server disconnected.\n", 21);
+	close(cli->cli_co);
+      }
+    }
+    close(socket_descriptor);
+    if (unix_descriptor >= 0) {
+      unlink(config_get()->unix_path);
+    }
+  }
+  _exit(signal_number);
+}
+
+/* Add a client to the registry, in the slot client_reserve counted */
+void add_client(client *cli){
+  client_shard *shard = &client_shards[cli->id % CLIENT_SHARDS];
+  pthread_mutex_lock(&shard->lock);
+  if ((cli->shard_next = shard->first)){
+    shard->first->shard_prev = &cli->shard_next;
+  }
+  cli->shard_prev = &shard->first;
+  shard->first = cli;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Remove a client from the registry and decrease the number of clients */
+void remove_client(client *cli){
+  client_shard *shard = &client_shards[cli->id % CLIENT_SHARDS];
+  tenant *t;
+  pthread_mutex_lock(&shard->lock);
+  if ((*cli->shard_prev = cli->shard_next)){
+    cli->shard_next->shard_prev = cli->shard_prev;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  __atomic_sub_fetch(&clients_number, 1, __ATOMIC_RELAXED);
+  if ((t = cli->tenant)){
+    pthread_mutex_lock(&t->lock);
+    member_list_remove(&t->members, &cli->tenant_slot);
+    name_index_remove(&t->users, cli);
+    pthread_mutex_unlock(&t->lock);
+  }
+}
+
+/* Rename a client, in the lists where its name appears too.
+   Return 0, or -1 if another user of its tenant has the name */
+int rename_client(client *cli, char *name){
+  client_shard *shard = &client_shards[cli->id % CLIENT_SHARDS];
+  tenant *t = cli->tenant;
+  int i;
+  pthread_mutex_lock(&t->lock);
+  if (name_index_find(&t->users, name)){
+    pthread_mutex_unlock(&t->lock);
+    return -1;
+  }
+  name_index_remove(&t->users, cli);
+  /* The stats timer reads the name under the lock of the shard */
+  pthread_mutex_lock(&shard->lock);
+  strcpy(cli->name, name);
+  pthread_mutex_unlock(&shard->lock);
+  name_index_add(&t->users, cli);
+  strcpy(t->members.names[cli->tenant_slot], name);
+  for (i = 0; i < channel_capacity; i++){
+    if (cli->subs[i].chan){
+      strcpy(cli->subs[i].chan->members.names[cli->subs[i].slot], name);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+  return 0;
+}
+
+/* Return a formatted list of at most limit users of the tenant t, starting at offset.
+   total is set to the number of users of the tenant */
+char* who_is_on_server(tenant *t, int offset, int limit, int *total){
+  char *list;
+  pthread_mutex_lock(&t->lock);
+  list = member_list_page(&t->members, offset, limit, total);
+  pthread_mutex_unlock(&t->lock);
+  return list;
+}
+
+/* Queue a message for the indexer thread, counted in search_pending already */
+static void search_enqueue(pending_message *pending){
+  pending->next = NULL;
+  pthread_mutex_lock(&search_queue_lock);
+  if (search_tail){
+    search_tail->next = pending;
+  }
+  else {
+    search_head = pending;
+  }
+  search_tail = pending;
+  pthread_cond_signal(&search_queue_ready);
+  pthread_mutex_unlock(&search_queue_lock);
+}
+
+/* Ask the indexer thread to drop the index of a removed channel of the
+   tenant t. Queued after the messages of the channel, never dropped */
+void search_forget(tenant *t, char *channel_name){
+  pending_message *pending;
+  /* A channel named global shares the index of the whole tenant */
+  if (!strcmp(channel_name, "global")){
+    return;
+  }
+  pending = malloc(sizeof(pending_message));
+  pending->msg = NULL;
+  pending->tenant = t;
+  strcpy(pending->channel, channel_name);
+  pthread_mutex_lock(&search_queue_lock);
+  search_pending++;
+  pthread_mutex_unlock(&search_queue_lock);
+  search_enqueue(pending);
+}
+
+/* Find the channel of the tenant t named chan_name.
+   Runs with the lock of t held. Return NULL if not found */
+channel *find_channel_by_name(tenant *t, char *chan_name){
+  return name_index_find(&t->channels, chan_name);
+}
+
+/* Add a channel of the tenant t to the channels array, if the server has
+   less than the max_channels of cfg. Runs with the lock of t held.
+   Return the channel, NULL if the server has too many */
+channel *add_channel(tenant *t, char *chan_name, config *cfg){
+  int cpu;
+  channel *chan;
+  member_list members;
+  pthread_mutex_lock(&state_lock);
+  if (channels_number >= (unsigned int)cfg->max_channels){
+    pthread_mutex_unlock(&state_lock);
+    return NULL;
+  }
+  /* Reuse a channel removed on the CPU of the creating client, its
+     memory was first touched there */
+  if ((cpu = sched_getcpu()) < 0 || cpu >= cpu_count){
+    cpu = 0;
+  }
+  if ((chan = channel_pools[cpu])){
+    channel_pools[cpu] = chan->next_free;
+    members = chan->members;
+  }
+  else {
+    chan = (channel *)aligned_alloc(CACHE_LINE, sizeof(channel));
+    memset(&members, 0, sizeof(member_list));
+  }
+  memset(chan, 0, sizeof(channel));
+  chan->members = members;
+  chan->cpu = cpu;
+  strcpy(chan->name,chan_name);
+  chan->id = free_channel_ids[channel_capacity - 1 - channels_number];
+  chan->tenant = t;
+  channels[chan->id] = chan;
+  channels_number++;
+  pthread_mutex_unlock(&state_lock);
+  t->channels_number++;
+  name_index_add(&t->channels, chan);
+  return chan;
+}
+
+/* Removes a channel of its tenant and from the channels array.
+   Runs with the lock of its tenant held */
+void remove_channel(channel *chan){
+  tenant *t = chan->tenant;
+  t->channels_number--;
+  name_index_remove(&t->channels, chan);
+  search_forget(t, chan->name);
+  if (chan->history){
+    history_release(chan->history);
+  }
+  pthread_mutex_lock(&state_lock);
+  channels_number--;
+  free_channel_ids[channel_capacity - 1 - channels_number] = chan->id;
+  channels[chan->id] = NULL;
+  /* Back to its pool, the arrays of its members kept, empty */
+  chan->next_free = channel_pools[chan->cpu];
+  channel_pools[chan->cpu] = chan;
+  pthread_mutex_unlock(&state_lock);
+}
+
+/* Take cli off a channel, and remove the channel once empty.
+   Runs with the lock of its tenant held. Return the number of users left
+   on the channel, -1 if cli wasn't on it */
+static int channel_remove_client(channel *chan, client *cli){
+  subscription *sub = &cli->subs[chan->id];
+  if (sub->chan != chan){
+    return -1;
+  }
+  member_list_remove(&chan->members, &sub->slot);
+  sub->chan = NULL;
+  if (!chan->members.count){
+    remove_channel(chan);
+    return 0;
+  }
+  return chan->members.count;
+}
+
+/* Remove every user from the channel of the tenant t named chan_name,
+   sending them msg, then the channel itself.
+   Return the number of users removed, -1 if there is no such channel */
+int close_channel(tenant *t, char *chan_name, char *msg){
+  int i, count = -1;
+  channel *chan;
+  message *m = message_create(msg);
+  m->refs = 1;
+  pthread_mutex_lock(&t->lock);
+  if ((chan = find_channel_by_name(t, chan_name))){
+    count = chan->members.count;
+    for (i = 0; i < count; i++){
+      chan->members.clients[i]->subs[chan->id].chan = NULL;
+      ops->deliver(chan->members.clients[i], m, PRIO_CONTROL);
+    }
+    chan->members.count = 0;
+    remove_channel(chan);
+  }
+  pthread_mutex_unlock(&t->lock);
+  message_release(m);
+  return count;
+}
+
+/* Say if a client is on a channel.
+   Runs with the lock of its tenant held. Return 0 if it is on the chan, -1 otherwise */
+int is_user_on_channel(client *cli, channel *chan){
+  return cli->subs[chan->id].chan == chan ? 0 : -1;
+}
+
+/* Add a client to the channel of its tenant named chan_name, creating the
+   channel if the server and tenant limits of cfg allow it. The lookup, the
+   limit checks and the change are done under the lock of the tenant, so two
+   clients can't create the same channel.
+   Return the number of users on the channel with the client, 0 if it was
+   already on it, -2 if the channel is full, -3 if there are too many channels */
+int add_client_to_channel(client *cli, char *chan_name, config *cfg){
+  tenant *t = cli->tenant;
+  int result;
+  channel *chan;
+  pthread_mutex_lock(&t->lock);
+  if (!(chan = find_channel_by_name(t, chan_name)) &&
+      (t->channels_number >= tenant_limits(cfg, t)->max_channels ||
+       !(chan = add_channel(t, chan_name, cfg)))){
+    result = -3;
+  }
+  else if (is_user_on_channel(cli, chan) == 0){
+    result = 0;
+  }
+  else if (chan->members.count >= cfg->max_users_by_channel){
+    result = -2;
+  }
+  else {
+    cli->subs[chan->id].chan = chan;
+    member_list_add(&chan->members, cli, &cli->subs[chan->id].slot);
+    result = chan->members.count;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return result;
+}
+
+/* Remove a client from the channel of its tenant named chan_name.
+   Return the number of users left on the channel, -1 if there is no such
+   channel, -2 if the client isn't on it */
+int remove_user_from_channel(client *cli, char *chan_name){
+  tenant *t = cli->tenant;
+  channel *chan;
+  int left;
+  pthread_mutex_lock(&t->lock);
+  if (!(chan = find_channel_by_name(t, chan_name))){
+    left = -1;
+  }
+  else if ((left = channel_remove_client(chan, cli)) < 0){
+    left = -2;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return left;
+}
+
+/* Remove a client that leaves from all its channels, in one locked pass:
+   an admin closing a channel meanwhile can't leave a dangling subscription */
+void remove_user_from_all_channels(client *cli){
+  tenant *t = cli->tenant;
+  int i;
+  if (!t){
+    return;
+  }
+  pthread_mutex_lock(&t->lock);
+  for (i = 0; i < channel_capacity; i++){
+    if (cli->subs[i].chan){
+      channel_remove_client(cli->subs[i].chan, cli);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+/* Say if a client is on the channel of its tenant named chan_name.
+   Return 0 if it is, -1 otherwise */
+int is_user_on_channel_named(client *cli, char *chan_name){
+  channel *chan;
+  int result;
+  pthread_mutex_lock(&cli->tenant->lock);
+  result = (chan = find_channel_by_name(cli->tenant, chan_name)) ? is_user_on_channel(cli, chan) : -1;
+  pthread_mutex_unlock(&cli->tenant->lock);
+  return result;
+}
+
+/* Return the number of users on the channel of the tenant t named chan_name,
+   -1 if there is no such channel */
+int channel_users(tenant *t, char *chan_name){
+  channel *chan;
+  int users = -1;
+  pthread_mutex_lock(&t->lock);
+  if ((chan = find_channel_by_name(t, chan_name))){
+    users = chan->members.count;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return users;
+}
+
+/* Return a formatted list of at most limit users of the channel of the
+   tenant t named chan_name, starting at offset. total is set to the number
+   of users on the channel. Return NULL if there is no such channel */
+char* who_is_on_channel(tenant *t, char *chan_name, int offset, int limit, int *total){
+  char *list = NULL;
+  channel *chan;
+  pthread_mutex_lock(&t->lock);
+  if ((chan = find_channel_by_name(t, chan_name))){
+    list = member_list_page(&chan->members, offset, limit, total);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return list;
+}
+
+/* Return the tenant named name, creating it on its first use.
+   Return NULL if the configuration doesn't declare it */
+tenant *tenant_find(char *name){
+  tenant *t;
+  pthread_mutex_lock(&state_lock);
+  for (t = tenants; t && strcmp(t->name, name); t = t->next);
+  if (!t && tenant_quota_of(config_get(), name) &&
+      !posix_memalign((void **)&t, CACHE_LINE, sizeof(tenant))){
+    memset(t, 0, sizeof(tenant));
+    strcpy(t->name, name);
+    pthread_mutex_init(&t->lock, NULL);
+    name_index_init(&t->users, offsetof(client, name_next), offsetof(client, name));
+    name_index_init(&t->channels, offsetof(channel, name_next), offsetof(channel, name));
+    t->next = tenants;
+    /* The accounting timer walks the list without the lock */
+    __atomic_store_n(&tenants, t, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&state_lock);
+  return t;
+}
+
+/* Put a client in a tenant, which is then charged for it.
+   Return 0, or -1 if the tenant has its quota of clients */
+int tenant_enter(client *cli, tenant *t){
+  pthread_mutex_lock(&t->lock);
+  if (t->members.count >= tenant_limits(config_get(), t)->max_clients){
+    pthread_mutex_unlock(&t->lock);
+    return -1;
+  }
+  cli->tenant = t;
+  member_list_add(&t->members, cli, &cli->tenant_slot);
+  name_index_add(&t->users, cli);
+  ops->charge(cli, t);
+  pthread_mutex_unlock(&t->lock);
+  return 0;
+}
+
+/* Sum the shards of every tenant on each tick, and flag those over their
+   message rate or their memory. The threads of the clients only add to
+   a shard and read the flags. Runs on the thread advancing the wheel */
+static void tenant_account(timer *t){
+  config *cfg = config_get();
+  tenant_quota *quota;
+  tenant *ten;
+  unsigned long messages;
+  long memory;
+  int i, slot = timer_now() % TENANT_HISTORY;
+  for (ten = __atomic_load_n(&tenants, __ATOMIC_ACQUIRE); ten; ten = ten->next){
+    messages = 0;
+    memory = 0;
+    for (i = 0; i < TENANT_SHARDS; i++){
+      messages += __atomic_load_n(&ten->shards[i].messages, __ATOMIC_RELAXED);
+      memory += __atomic_load_n(&ten->shards[i].memory, __ATOMIC_RELAXED);
+    }
+    quota = tenant_limits(cfg, ten);
+    /* history[slot] holds the count of one second ago */
+    __atomic_store_n(&ten->throttled, quota->max_message_rate &&
+		     messages - ten->history[slot] >= (unsigned long)quota->max_message_rate,
+		     __ATOMIC_RELAXED);
+    ten->history[slot] = messages;
+    __atomic_store_n(&ten->over_memory, quota->max_memory && memory > (long)quota->max_memory,
+		     __ATOMIC_RELAXED);
+  }
+  timer_arm(t, 1);
+}
+
+/* Send a presence message to the clients of the channel of t named chan_name,
+   or of the whole tenant if chan_name is "", leaving out those who opted out */
+static void send_presence(char *msg, tenant *t, char *chan_name){
+  int i;
+  channel *chan;
+  member_list *members = NULL;
+  message *m = message_create(msg);
+  m->refs = 1;
+  pthread_mutex_lock(&t->lock);
+  if (!chan_name[0]){
+    members = &t->members;
+  }
+  else if ((chan = find_channel_by_name(t, chan_name))){
+    members = &chan->members;
+  }
+  for (i = 0; members && i < members->count; i++){
+    if (members->clients[i]->presence){
+      ops->deliver(members->clients[i], m, PRIO_CHANNEL);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+  message_release(m);
+}
+
+/* Send the digests of a window. A lone change keeps its usual message */
+static void presence_flush(presence_digest *d){
+  static const char *verbs[PRESENCE_KINDS] = { "joined", "left" };
+  char out[BUFFER_SIZE], where[MAX_NAME_SIZE + 16];
+  presence_digest *next;
+  int kind, i, length;
+  for (; d; d = next){
+    next = d->next;
+    if (d->channel[0]){
+      sprintf(where, "channel %s", d->channel);
+    }
+    else {
+      strcpy(where, "the chat");
+    }
+    for (kind = 0; kind < PRESENCE_KINDS; kind++){
+      if (d->count[kind] == 1 && d->channel[0]){
+	sprintf(out, kind == PRESENCE_JOINED ? "%s had joined channel %s.\n" :
+		"%s left channel %s.\n", d->names[kind][0], d->channel);
+      }
+      else if (d->count[kind] == 1){
+	sprintf(out, kind == PRESENCE_JOINED ? "%s has joined the chat.\n" :
+		"%s has left the chat.\n", d->names[kind][0]);
+      }
+      else if (d->count[kind] > 1){
+	length = sprintf(out, "%d users %s %s:", d->count[kind], verbs[kind], where);
+	for (i = 0; i < d->count[kind] && i < PRESENCE_NAMES; i++){
+	  length += sprintf(out + length, "%s %s", i ? "," : "", d->names[kind][i]);
+	}
+	if (d->count[kind] > PRESENCE_NAMES){
+	  length += sprintf(out + length, " and %d others", d->count[kind] - PRESENCE_NAMES);
+	}
+	sprintf(out + length, ".\n");
+      }
+      else {
+	continue;
+      }
+      send_presence(out, d->tenant, d->channel);
+    }
+    free(d);
+  }
+}
+
+/* End of a presence window: send what was gathered during it */
+static void presence_expired(timer *t){
+  presence_digest *d;
+  pthread_mutex_lock(&presence_lock);
+  d = presence_pending;
+  presence_pending = NULL;
+  pthread_mutex_unlock(&presence_lock);
+  presence_flush(d);
+}
+
+/* Report that name joined or left (kind) the channel of t named channel,
+   or the tenant if channel is "". The first change of a window starts it */
+void presence_post(tenant *t, char *channel, int kind, char *name){
+  config *cfg = config_get();
+  presence_digest *d;
+  int first;
+  pthread_mutex_lock(&presence_lock);
+  first = !presence_pending;
+  for (d = presence_pending; d && (d->tenant != t || strcmp(d->channel, channel)); d = d->next);
+  if (!d){
+    d = calloc(1, sizeof(presence_digest));
+    d->tenant = t;
+    strcpy(d->channel, channel);
+    d->next = presence_pending;
+    presence_pending = d;
+  }
+  if (d->count[kind] < PRESENCE_NAMES){
+    strcpy(d->names[kind][d->count[kind]], name);
+  }
+  d->count[kind]++;
+  pthread_mutex_unlock(&presence_lock);
+  /* Without a window, the change is sent right away as if the window ended */
+  if (!cfg->presence_window){
+    presence_expired(&presence_timer);
+  }
+  else if (first){
+    timer_arm(&presence_timer, (cfg->presence_window + TIMER_TICK - 1) / TIMER_TICK);
+  }
+}
+
+/* Read up to length bytes from the ring of cli, waiting for the client to
+   write some. Once upgraded the socket only tells when the client is gone,
+   bytes still sent there are dropped.
+   Return the bytes read, 0 when the client is gone, -1 on error */
+static ssize_t shm_read(client *cli, char *buffer, size_t length){
+  shm_ring *r = cli->shm;
+  struct pollfd fds[2];
+  unsigned long head, tail = cli->shm_tail;
+  uint64_t value;
+  size_t first;
+  char drain[BUFFER_SIZE];
+  ssize_t n;
+  fds[0].fd = cli->cli_co;
+  fds[1].fd = cli->shm_data;
+  fds[0].events = fds[1].events = POLLIN;
+  while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail){
+    fds[0].revents = fds[1].revents = 0;
+    __atomic_store_n(&r->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    /* Look again, the client may have written before seeing the flag */
+    if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail &&
+	poll(fds, 2, -1) < 0 && errno != EINTR){
+      return -1;
+    }
+    __atomic_store_n(&r->reader_waiting, 0, __ATOMIC_RELAXED);
+    if (fds[1].revents & POLLIN){
+      read(cli->shm_data, &value, sizeof(value));
+    }
+    if (fds[0].revents && (n = recv(cli->cli_co, drain, sizeof(drain), MSG_DONTWAIT)) <= 0 &&
+	!(n < 0 && (errno == EAGAIN || errno == EINTR))){
+      return 0;
+    }
+  }
+  /* A client moving head past the ring is cut off */
+  if (head - tail > cli->shm_size){
+    return -1;
+  }
+  if (length > head - tail){
+    length = head - tail;
+  }
+  first = cli->shm_size - (tail & (cli->shm_size - 1));
+  if (first > length){
+    first = length;
+  }
+  memcpy(buffer, r->data + (tail & (cli->shm_size - 1)), first);
+  memcpy(buffer + first, r->data, length - first);
+  cli->shm_tail = tail + length;
+  __atomic_store_n(&r->tail, cli->shm_tail, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->writer_waiting, __ATOMIC_SEQ_CST)){
+    value = 1;
+    write(cli->shm_space, &value, sizeof(value));
+  }
+  return length;
+}
+
+/* Read up to length bytes sent by cli, through its ring after /shm and its
+   socket otherwise. Return the bytes read, 0 when the client is gone, -1 on error */
+static ssize_t client_read(client *cli, char *buffer, size_t length){
+  if (cli->shm){
+    return shm_read(cli, buffer, length);
+  }
+  return read(cli->cli_co, buffer, length);
+}
+
+/* Answer /shm: create the ring of cli in a sealed memfd, and pass it with the two
+   eventfds to the client over its Unix socket, along with "SHM <size>".
+   Runs in the thread reading the client. Return 0 on success, -1 otherwise */
+static int shm_upgrade(client *cli){
+  size_t size = config_get()->shm_ring_size;
+  int fds[3] = { -1, -1, -1 }, i, sent = 0;
+  char reply[MAX_NAME_SIZE];
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr hdr;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  shm_ring *r = MAP_FAILED;
+
+  /* Sealed at its size: a client shrinking it would make the server
+     fault with SIGBUS on its next read of the ring */
+  if ((fds[0] = memfd_create("chat-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0 &&
+      ftruncate(fds[0], sizeof(shm_ring) + size) == 0 &&
+      fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0){
+    r = mmap(NULL, sizeof(shm_ring) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  }
+  if (r != MAP_FAILED){
+    fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+  if (fds[1] >= 0 && fds[2] >= 0){
+    sprintf(reply, CONTROL_MARK "SHM %zu\n", size);
+    iov.iov_base = reply;
+    iov.iov_len = strlen(reply) + 1;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buffer;
+    hdr.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    /* Between two batches of the writer, like the chunks of a /send */
+    pthread_mutex_lock(&cli->out.write_lock);
+    sent = sendmsg(cli->cli_co, &hdr, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+    pthread_mutex_unlock(&cli->out.write_lock);
+  }
+  else {
+    perror("error: unable to create the shared ring");
+  }
+  if (!sent){
+    if (r != MAP_FAILED){
+      munmap(r, sizeof(shm_ring) + size);
+    }
+    for (i = 0; i < 3; i++){
+      if (fds[i] >= 0){
+	close(fds[i]);
+      }
+    }
+    return -1;
+  }
+  /* The mapping keeps the memory */
+  close(fds[0]);
+  cli->shm_size = size;
+  cli->shm_tail = 0;
+  cli->shm_data = fds[1];
+  cli->shm_space = fds[2];
+  cli->shm = r;
+  return 0;
+}
+
+/* Release the ring of a client that left */
+static void shm_close(client *cli){
+  if (!cli->shm){
+    return;
+  }
+  munmap(cli->shm, sizeof(shm_ring) + cli->shm_size);
+  close(cli->shm_data);
+  close(cli->shm_space);
+  cli->shm = NULL;
+}
+
+/* Recipient of a /send */
+typedef struct {
+  client *cli;
+  int pipe[2];           /* Pipe the payload is teed into, the last recipient reads the main one */
+  unsigned long flushes; /* Batches written to the recipient when it got the previous chunk */
+  int failed;            /* 1 once the recipient can't take more of the transfer */
+} transfer_target;
+
+/* Write length bytes of data to a socket. Return 0 on success, -1 on error */
+static int send_all(int fd, const char *data, size_t length){
+  ssize_t written;
+  while (length > 0){
+    if ((written = send(fd, data, length, MSG_NOSIGNAL)) < 0){
+      if (errno == EINTR){
+	continue;
+      }
+      return -1;
+    }
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+
+/* Move length bytes from a pipe to fd without copying them in user space.
+   Return the number of bytes moved, less than length on error */
+static size_t splice_all(int pipe_out, int fd, size_t length){
+  size_t moved = 0;
+  ssize_t n;
+  while (moved < length){
+    if ((n = splice(pipe_out, NULL, fd, NULL, length - moved, SPLICE_F_MOVE)) <= 0){
+      if (n < 0 && errno == EINTR){
+	continue;
+      }
+      break;
+    }
+    moved += n;
+  }
+  return moved;
+}
+
+/* Wait until the writer of a recipient sent a batch of its queue since the
+   previous chunk, so a transfer can't starve the chat. Then take the
+   connection for the next chunk. Return -1 if the recipient left */
+static int transfer_take_turn(transfer_target *t){
+  outqueue *q = &t->cli->out;
+  pthread_mutex_lock(&q->lock);
+  while (q->bytes && q->flushes == t->flushes && !q->dead && !q->closing){
+    pthread_cond_wait(&q->flushed, &q->lock);
+  }
+  t->flushes = q->flushes;
+  if (q->dead || q->closing){
+    pthread_mutex_unlock(&q->lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  pthread_mutex_lock(&q->write_lock);
+  return 0;
+}
+
+/* Write a chunk of a transfer to a recipient: a CONTROL_MARK "DATA <length>" message, then
+   the raw bytes, taken from pipe_out or from data if it isn't NULL.
+   The bytes not delivered are drained from the pipe into null_fd */
+static void transfer_chunk(transfer_target *t, char *prefix, const char *data,
+			   int pipe_out, size_t length, int null_fd){
+  char header[MAX_NAME_SIZE];
+  size_t moved = 0;
+  sprintf(header, CONTROL_MARK "DATA %zu\n", length);
+  if (!t->failed && transfer_take_turn(t) == 0){
+    if ((prefix && send_all(t->cli->cli_co, prefix, strlen(prefix) + 1) < 0) ||
+	(length && send_all(t->cli->cli_co, header, strlen(header) + 1) < 0)){
+      t->failed = 1;
+    }
+    else if (data){
+      t->failed = send_all(t->cli->cli_co, data, length) < 0;
+      moved = length;
+    }
+    else {
+      moved = splice_all(pipe_out, t->cli->cli_co, length);
+      t->failed = moved < length;
+    }
+    pthread_mutex_unlock(&t->cli->out.write_lock);
+  }
+  else {
+    t->failed = 1;
+  }
+  if (!data && moved < length){
+    splice_all(pipe_out, null_fd, length - moved);
+  }
+}
+
+/* Read size bytes from the connection of cli and drop them */
+static int discard_payload(client *cli, size_t size, int backend){
+  int pipe_fd[2], null_fd, result = 0;
+  char chunk[BUFFER_SIZE];
+  ssize_t n;
+  if (backend == IO_COPY){
+    while (size > 0){
+      if ((n = client_read(cli, chunk, size < sizeof(chunk) ? size : sizeof(chunk))) <= 0){
+	return -1;
+      }
+      size -= n;
+    }
+    return 0;
+  }
+  if (pipe(pipe_fd) < 0){
+    return -1;
+  }
+  null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  while (size > 0){
+    if ((n = splice(cli->cli_co, NULL, pipe_fd[1], NULL,
+		    size < TRANSFER_CHUNK ? size : TRANSFER_CHUNK, SPLICE_F_MOVE)) <= 0){
+      result = -1;
+      break;
+    }
+    splice_all(pipe_fd[0], null_fd, n);
+    size -= n;
+  }
+  close(null_fd);
+  close(pipe_fd[0]);
+  close(pipe_fd[1]);
+  return result;
+}
+
+/* Find the recipients of a /send of size bytes from cli to target: the
+   other members of the channel of its tenant named so, else the user of
+   its tenant named so. targets holds user_capacity of them. The line that
+   announces the transfer to them is written in out.
+   Runs with the lock of its tenant held. Return the number of recipients */
+int transfer_targets(client *cli, char *target, size_t size, transfer_target *targets, char *out){
+  channel *chan;
+  client *user;
+  int i, count = 0;
+  if ((chan = find_channel_by_name(cli->tenant, target))){
+    for (i = 0; i < chan->members.count; i++){
+      if (chan->members.clients[i] != cli){
+	targets[count++].cli = chan->members.clients[i];
+      }
+    }
+    sprintf(out, "%s sends on %s %zu bytes:\n", cli->name, target, size);
+  }
+  else {
+    if ((user = name_index_find(&cli->tenant->users, target)) && user != cli){
+      targets[count++].cli = user;
+    }
+    sprintf(out, "%s sends you %zu bytes:\n", cli->name, size);
+  }
+  return count;
+}
+
+/* Tell cli how its /send of size bytes to target, count recipients, went */
+void transfer_report(client *cli, char *target, size_t size, int count){
+  char out[BUFFER_SIZE];
+  if (count){
+    sprintf(out, "Sent %zu bytes to %s.\n", size, target);
+  }
+  else {
+    sprintf(out, "No user or channel named %s.\n", target);
+  }
+  send_message_to_client(out, cli, PRIO_CONTROL);
+}
+
+/* Handle /send <name|channel> <size>: relay the size bytes following the
+   command from the connection of cli to the recipients. The payload goes
+   through a pipe with splice, and tee for each additional recipient, so it
+   never lands in user space, except for the pending bytes already read with
+   the command. The copy backend reads it in a buffer instead. It is relayed
+   in chunks of TRANSFER_CHUNK and other messages are written to the
+   recipients between two chunks.
+   Return -1 if the connection of cli was lost during the transfer */
+int relay_transfer(client *cli, char *target, size_t size, const char *pending, size_t pending_length){
+  config *cfg = config_get();
+  transfer_target *targets;
+  char out[BUFFER_SIZE], *copy = NULL;
+  int i, count, main_pipe[2] = { -1, -1 }, null_fd, lost = 0;
+  size_t left = size - pending_length;
+  ssize_t n;
+  /* Bytes in shared memory can't be spliced */
+  int backend = cli->shm ? IO_COPY : cfg->io_backend;
+
+  if (size > cfg->max_transfer_size){
+    sprintf(out, "Transfers are limited to %zu bytes.\n", cfg->max_transfer_size);
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    return discard_payload(cli, left, backend);
+  }
+
+  /* Find the recipients, and keep them until the transfer is over */
+  targets = calloc(user_capacity, sizeof(transfer_target));
+  pthread_mutex_lock(&cli->tenant->lock);
+  count = transfer_targets(cli, target, size, targets, out);
+  for (i = 0; i < count; i++){
+    pthread_mutex_lock(&targets[i].cli->out.lock);
+    targets[i].cli->out.transfers++;
+    targets[i].pipe[0] = targets[i].pipe[1] = -1;
+    pthread_mutex_unlock(&targets[i].cli->out.lock);
+  }
+  pthread_mutex_unlock(&cli->tenant->lock);
+
+  null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (count && backend == IO_COPY){
+    copy = malloc(TRANSFER_CHUNK);
+  }
+  else if (count && pipe(main_pipe) == 0){
+    for (i = 0; i < count - 1; i++){
+      if (pipe(targets[i].pipe) < 0){
+	targets[i].failed = 1;
+      }
+    }
+  }
+
+  if (!copy && main_pipe[0] < 0){
+    lost = discard_payload(cli, left, backend) < 0;
+  }
+  else {
+    /* The bytes read with the command are copied, the rest is spliced */
+    for (i = 0; i < count; i++){
+      transfer_chunk(&targets[i], out, pending, -1, pending_length, null_fd);
+    }
+    while (left > 0){
+      if (copy){
+	n = client_read(cli, copy, left < TRANSFER_CHUNK ? left : TRANSFER_CHUNK);
+      }
+      else {
+	n = splice(cli->cli_co, NULL, main_pipe[1], NULL,
+		   left < TRANSFER_CHUNK ? left : TRANSFER_CHUNK, SPLICE_F_MOVE);
+      }
+      if (n <= 0){
+	if (n < 0 && errno == EINTR){
+	  continue;
+	}
+	lost = 1;
+	break;
+      }
+      __atomic_store_n(&cli->last_seen, timer_now() | 1, __ATOMIC_RELAXED);
+      left -= n;
+      if (copy){
+	for (i = 0; i < count; i++){
+	  transfer_chunk(&targets[i], NULL, copy, -1, n, null_fd);
+	}
+	continue;
+      }
+      /* Duplicate the chunk for every recipient but the last one */
+      for (i = 0; i < count - 1; i++){
+	if (targets[i].pipe[0] < 0 ||
+	    tee(main_pipe[0], targets[i].pipe[1], n, 0) != n){
+	  targets[i].failed = 1;
+	  if (targets[i].pipe[0] >= 0){
+	    close(targets[i].pipe[0]);
+	    close(targets[i].pipe[1]);
+	    targets[i].pipe[0] = targets[i].pipe[1] = -1;
+	  }
+	  continue;
+	}
+	transfer_chunk(&targets[i], NULL, NULL, targets[i].pipe[0], n, null_fd);
+      }
+      transfer_chunk(&targets[count - 1], NULL, NULL, main_pipe[0], n, null_fd);
+    }
+    if (main_pipe[0] >= 0){
+      close(main_pipe[0]);
+      close(main_pipe[1]);
+    }
+  }
+  free(copy);
+
+  /* Tell the recipients the transfer is over, and let them go */
+  sprintf(out, lost ? "\nTransfer from %s interrupted.\n" : "\nEnd of transfer from %s.\n",
+	  cli->name);
+  for (i = 0; i < count; i++){
+    if (!targets[i].failed){
+      send_message_to_client(out, targets[i].cli, PRIO_PRIVATE);
+    }
+    if (targets[i].pipe[0] >= 0){
+      close(targets[i].pipe[0]);
+      close(targets[i].pipe[1]);
+    }
+    pthread_mutex_lock(&targets[i].cli->out.lock);
+    targets[i].cli->out.transfers--;
+    pthread_cond_broadcast(&targets[i].cli->out.flushed);
+    pthread_mutex_unlock(&targets[i].cli->out.lock);
+  }
+  close(null_fd);
+  if (!lost){
+    transfer_report(cli, target, size, count);
+  }
+  free(targets);
+  return lost ? -1 : 0;
+}
+
+/* Read the next term of text into term (lowercase letters and digits).
+   Return a pointer after the term, or NULL if there is none left */
+static const char *next_term(const char *text, char *term){
+  int length = 0;
+  while (*text && !isalnum((unsigned char)*text)){
+    text++;
+  }
+  if (!*text){
+    return NULL;
+  }
+  while (isalnum((unsigned char)*text)){
+    if (length < MAX_NAME_SIZE - 1){
+      term[length++] = tolower((unsigned char)*text);
+    }
+    text++;
+  }
+  term[length] = '\0';
+  return text;
+}
+
+/* Find the posting list of term in a segment, or the free slot where it goes */
+static posting_list *segment_lookup(segment *seg, const char *term){
+  unsigned int slot = hash_string(term) & (seg->term_capacity - 1);
+  while (seg->terms[slot].term && strcmp(seg->terms[slot].term, term)){
+    slot = (slot + 1) & (seg->term_capacity - 1);
+  }
+  return &seg->terms[slot];
+}
+
+/* Double the size of the term table of a segment */
+static void segment_grow_terms(segment *seg){
+  posting_list *old = seg->terms, *list;
+  unsigned int i, old_capacity = seg->term_capacity;
+  seg->term_capacity = old_capacity ? old_capacity * 2 : 64;
+  seg->terms = calloc(seg->term_capacity, sizeof(posting_list));
+  seg->bytes += (seg->term_capacity - old_capacity) * sizeof(posting_list);
+  for (i = 0; i < old_capacity; i++){
+    if (old[i].term){
+      list = segment_lookup(seg, old[i].term);
+      *list = old[i];
+    }
+  }
+  free(old);
+}
+
+/* Append id to the posting list of term in a segment. Ids come in increasing order */
+static void segment_add_posting(segment *seg, const char *term, unsigned int id){
+  posting_list *list;
+  unsigned int delta;
+  if ((seg->term_count + 1) * 10 > seg->term_capacity * 7){
+    segment_grow_terms(seg);
+  }
+  list = segment_lookup(seg, term);
+  if (!list->term){
+    list->term = strdup(term);
+    seg->term_count++;
+    seg->bytes += strlen(term) + 1;
+  }
+  /* A term repeated in a message is only recorded once */
+  else if (list->last == id){
+    return;
+  }
+  delta = list->count ? id - list->last : id;
+  if (list->length + 5 > list->capacity){
+    seg->bytes += list->capacity ? list->capacity : 8;
+    list->capacity = list->capacity ? list->capacity * 2 : 8;
+    list->data = realloc(list->data, list->capacity);
+  }
+  /* 7 bits per byte, the high bit tells another byte follows */
+  while (delta >= 0x80){
+    list->data[list->length++] = (delta & 0x7f) | 0x80;
+    delta >>= 7;
+  }
+  list->data[list->length++] = delta;
+  list->last = id;
+  list->count++;
+}
+
+/* Decode a posting list in ids, which must hold list->count ids */
+static void posting_decode(posting_list *list, unsigned int *ids){
+  size_t i = 0;
+  unsigned int n, value = 0, delta;
+  int shift;
+  for (n = 0; n < list->count; n++){
+    delta = 0;
+    shift = 0;
+    while (list->data[i] & 0x80){
+      delta |= (list->data[i++] & 0x7f) << shift;
+      shift += 7;
+    }
+    delta |= list->data[i++] << shift;
+    value = n ? value + delta : delta;
+    ids[n] = value;
+  }
+}
+
+/* Add a message at the end of a segment and index its terms */
+static void segment_add_message(segment *seg, indexed_message *msg){
+  char term[MAX_NAME_SIZE];
+  const char *text = msg->text;
+  unsigned int id = seg->message_count;
+  size_t length = sizeof(indexed_message) + strlen(msg->text) + 1;
+  if (seg->message_count == seg->message_capacity){
+    seg->bytes += (seg->message_capacity ? seg->message_capacity : 64) * sizeof(indexed_message *);
+    seg->message_capacity = seg->message_capacity ? seg->message_capacity * 2 : 64;
+    seg->messages = realloc(seg->messages, seg->message_capacity * sizeof(indexed_message *));
+  }
+  seg->message_bytes += length;
+  seg->bytes += length;
+  if (!seg->message_count){
+    seg->start = msg->time;
+  }
+  seg->messages[seg->message_count++] = msg;
+  while ((text = next_term(text, term))){
+    segment_add_posting(seg, term, id);
+  }
+  /* The sender can be searched for too */
+  if (next_term(msg->sender, term)){
+    segment_add_posting(seg, term, id);
+  }
+}
+
+/* Free a segment. Its messages are freed too if free_messages is 1 */
+static void segment_free(segment *seg, int free_messages){
+  unsigned int i;
+  for (i = 0; i < seg->term_capacity; i++){
+    free(seg->terms[i].term);
+    free(seg->terms[i].data);
+  }
+  if (free_messages){
+    for (i = 0; i < seg->message_count; i++){
+      free(seg->messages[i]);
+    }
+  }
+  free(seg->messages);
+  free(seg->terms);
+  free(seg);
+}
+
+/* Build a segment holding the messages of old then young, re-encoding their postings */
+static segment *segment_merge(segment *old, segment *young){
+  segment *seg = calloc(1, sizeof(segment));
+  segment *parts[2] = { old, young };
+  unsigned int i, j, k, base = 0, *ids = NULL, ids_capacity = 0;
+  posting_list *list;
+  seg->message_capacity = old->message_count + young->message_count;
+  seg->messages = malloc(seg->message_capacity * sizeof(indexed_message *));
+  memcpy(seg->messages, old->messages, old->message_count * sizeof(indexed_message *));
+  memcpy(seg->messages + old->message_count, young->messages,
+	 young->message_count * sizeof(indexed_message *));
+  seg->message_count = seg->message_capacity;
+  seg->start = old->start;
+  /* The messages now belong to the merged segment */
+  seg->message_bytes = old->message_bytes + young->message_bytes;
+  seg->bytes = seg->message_bytes + seg->message_capacity * sizeof(indexed_message *);
+  for (k = 0; k < 2; k++){
+    for (i = 0; i < parts[k]->term_capacity; i++){
+      list = &parts[k]->terms[i];
+      if (!list->term){
+	continue;
+      }
+      if (list->count > ids_capacity){
+	ids_capacity = list->count;
+	ids = realloc(ids, ids_capacity * sizeof(unsigned int));
+      }
+      posting_decode(list, ids);
+      for (j = 0; j < list->count; j++){
+	segment_add_posting(seg, list->term, base + ids[j]);
+      }
+    }
+    base += parts[k]->message_count;
+  }
+  free(ids);
+  return seg;
+}
+
+/* Return the link to the index of a channel of the tenant t, pointing to
+   NULL if there is none. Runs with search_table_lock held */
+static search_channel **search_lookup(tenant *t, const char *name){
+  search_channel **link = &search_table[hash_string(name) % SEARCH_BUCKETS];
+  for (; *link && ((*link)->tenant != t || strcmp((*link)->name, name)); link = &(*link)->next);
+  return link;
+}
+
+/* Return the index of a channel of the tenant t, creating it if create is 1 */
+static search_channel *search_find_channel(tenant *t, const char *name, int create){
+  unsigned int bucket = hash_string(name) % SEARCH_BUCKETS;
+  search_channel *chan;
+  pthread_mutex_lock(&search_table_lock);
+  chan = *search_lookup(t, name);
+  if (!chan && create){
+    chan = calloc(1, sizeof(search_channel));
+    chan->tenant = t;
+    strcpy(chan->name, name);
+    pthread_rwlock_init(&chan->lock, NULL);
+    chan->next = search_table[bucket];
+    search_table[bucket] = chan;
+  }
+  pthread_mutex_unlock(&search_table_lock);
+  return chan;
+}
+
+/* Replace the segments first and first+1 of a channel by merged */
+static void search_replace_segments(search_channel *chan, int first, segment *merged){
+  segment *old = chan->segments[first], *young = chan->segments[first + 1];
+  pthread_rwlock_wrlock(&chan->lock);
+  chan->segments[first] = merged;
+  memmove(chan->segments + first + 1, chan->segments + first + 2,
+	  (chan->segment_count - first - 2) * sizeof(segment *));
+  chan->segment_count--;
+  pthread_rwlock_unlock(&chan->lock);
+  search_memory += merged->bytes - old->bytes - young->bytes;
+  segment_free(old, 0);
+  segment_free(young, 0);
+}
+
+/* Drop the oldest segment of a channel and its messages. Indexer thread only */
+static void search_drop_oldest(search_channel *chan){
+  segment *dropped;
+  pthread_rwlock_wrlock(&chan->lock);
+  dropped = chan->segments[0];
+  memmove(chan->segments, chan->segments + 1, (chan->segment_count - 1) * sizeof(segment *));
+  chan->segment_count--;
+  chan->message_count -= dropped->message_count;
+  pthread_rwlock_unlock(&chan->lock);
+  search_memory -= dropped->bytes;
+  segment_free(dropped, 1);
+}
+
+/* Drop the oldest sealed segments of all the channels until the indexes fit
+   in search_memory. Indexer thread only */
+static void search_trim(size_t limit){
+  search_channel *chan, *oldest;
+  int i;
+  while (search_memory > limit){
+    oldest = NULL;
+    pthread_mutex_lock(&search_table_lock);
+    for (i = 0; i < SEARCH_BUCKETS; i++){
+      for (chan = search_table[i]; chan; chan = chan->next){
+	if (chan->segment_count > 1 &&
+	    (!oldest || chan->segments[0]->start < oldest->segments[0]->start)){
+	  oldest = chan;
+	}
+      }
+    }
+    pthread_mutex_unlock(&search_table_lock);
+    /* Only the indexer removes indexes, oldest stays valid */
+    if (!oldest){
+      return;
+    }
+    search_drop_oldest(oldest);
+  }
+}
+
+/* Remove the index of a channel of the tenant t and free it. Indexer thread only */
+static void search_remove_channel(tenant *t, const char *name){
+  search_channel **link, *chan;
+  pthread_mutex_lock(&search_table_lock);
+  if ((chan = *(link = search_lookup(t, name)))){
+    *link = chan->next;
+  }
+  pthread_mutex_unlock(&search_table_lock);
+  if (!chan){
+    return;
+  }
+  /* Wait for the queries still reading it, none can find it anymore */
+  pthread_rwlock_wrlock(&chan->lock);
+  pthread_rwlock_unlock(&chan->lock);
+  while (chan->segment_count){
+    search_drop_oldest(chan);
+  }
+  pthread_rwlock_destroy(&chan->lock);
+  free(chan->segments);
+  free(chan);
+}
+
+/* Seal the segment receiving the messages of a channel and open a new one.
+   The sealed segments are then merged two by two while the older one isn't
+   larger than the younger one, so a channel keeps a logarithmic number of
+   segments. The merges are built without holding the lock, only the swap
+   holds it. Segments over SEARCH_RETENTION messages are dropped, oldest first */
+static void search_seal(search_channel *chan){
+  segment *merged;
+  int last;
+  pthread_rwlock_wrlock(&chan->lock);
+  if (chan->segment_count == chan->segment_capacity){
+    chan->segment_capacity = chan->segment_capacity ? chan->segment_capacity * 2 : 8;
+    chan->segments = realloc(chan->segments, chan->segment_capacity * sizeof(segment *));
+  }
+  chan->segments[chan->segment_count++] = calloc(1, sizeof(segment));
+  pthread_rwlock_unlock(&chan->lock);
+  /* Only the indexer thread modifies the segments, it can read them unlocked */
+  while ((last = chan->segment_count - 2) >= 1 &&
+	 chan->segments[last - 1]->message_count <= chan->segments[last]->message_count){
+    merged = segment_merge(chan->segments[last - 1], chan->segments[last]);
+    search_replace_segments(chan, last - 1, merged);
+  }
+  while (chan->segment_count > 1 &&
+	 chan->message_count - chan->segments[0]->message_count >= SEARCH_RETENTION){
+    search_drop_oldest(chan);
+  }
+}
+
+/* Index a message in the index of its channel */
+static void search_index(tenant *t, const char *name, indexed_message *msg){
+  search_channel *chan = search_find_channel(t, name, 1);
+  segment *active;
+  size_t bytes;
+  if (!chan->segment_count){
+    search_seal(chan);
+  }
+  active = chan->segments[chan->segment_count - 1];
+  /* Time partitioning: a segment covers SEARCH_SEGMENT_SIZE messages or SEARCH_SEGMENT_TIME seconds */
+  if (active->message_count >= SEARCH_SEGMENT_SIZE ||
+      (active->message_count && msg->time - active->start >= SEARCH_SEGMENT_TIME)){
+    search_seal(chan);
+    active = chan->segments[chan->segment_count - 1];
+  }
+  bytes = active->bytes;
+  pthread_rwlock_wrlock(&chan->lock);
+  segment_add_message(active, msg);
+  chan->message_count++;
+  pthread_rwlock_unlock(&chan->lock);
+  search_memory += active->bytes - bytes;
+  search_trim(config_get()->search_memory);
+}
+
+/* Index the next message submitted by the clients, or drop the index of
+   a removed channel, waiting for one if wait is set.
+   Return 0 if nothing was waiting */
+int search_step(int wait){
+  pending_message *pending;
+  pthread_mutex_lock(&search_queue_lock);
+  while (wait && !search_head){
+    pthread_cond_wait(&search_queue_ready, &search_queue_lock);
+  }
+  if (!(pending = search_head)){
+    pthread_mutex_unlock(&search_queue_lock);
+    return 0;
+  }
+  if (!(search_head = pending->next)){
+    search_tail = NULL;
+  }
+  search_pending--;
+  pthread_mutex_unlock(&search_queue_lock);
+  config_enter();
+  if (pending->msg){
+    search_index(pending->tenant, pending->channel, pending->msg);
+  }
+  else {
+    search_remove_channel(pending->tenant, pending->channel);
+  }
+  config_leave();
+  free(pending);
+  return 1;
+}
+
+/* Handle the indexer thread: index the messages submitted by the clients
+   and drop the indexes of the removed channels */
+void *search_loop(void *arg){
+  config_reader reader;
+  config_register(&reader);
+  for (;;){
+    search_step(1);
+  }
+  return NULL;
+}
+
+/* Submit a message sent on a channel of the tenant t to the indexer thread.
+   It never waits for the indexing: when too many messages are waiting, it is dropped */
+void search_submit(tenant *t, char *channel_name, char *sender, const char *text, size_t length){
+  pending_message *pending;
+  pthread_mutex_lock(&search_queue_lock);
+  if (search_pending >= SEARCH_QUEUE_SIZE){
+    search_dropped++;
+    pthread_mutex_unlock(&search_queue_lock);
+    return;
+  }
+  search_pending++;
+  pthread_mutex_unlock(&search_queue_lock);
+  pending = malloc(sizeof(pending_message));
+  pending->msg = malloc(sizeof(indexed_message) + length + 1);
+  pending->msg->time = ops->wall_time();
+  strcpy(pending->msg->sender, sender);
+  memcpy(pending->msg->text, text, length);
+  pending->msg->text[length] = '\0';
+  pending->tenant = t;
+  strcpy(pending->channel, channel_name);
+  search_enqueue(pending);
+}
+
+/* Find the messages of a segment holding all the terms.
+   Return the number of ids written in matches, newest first */
+static unsigned int segment_search(segment *seg, char terms[][MAX_NAME_SIZE], int term_count,
+				   unsigned int *matches, unsigned int max){
+  posting_list *lists[SEARCH_MAX_TERMS], *list;
+  unsigned int *ids, *other, count, other_count, i, j, n, found = 0;
+  int t;
+  if (!seg->term_capacity){
+    return 0;
+  }
+  for (t = 0; t < term_count; t++){
+    lists[t] = segment_lookup(seg, terms[t]);
+    if (!lists[t]->term){
+      return 0;
+    }
+  }
+  /* Start from the shortest list, and keep the ids found in every other one */
+  for (t = 1; t < term_count; t++){
+    if (lists[t]->count < lists[0]->count){
+      list = lists[0];
+      lists[0] = lists[t];
+      lists[t] = list;
+    }
+  }
+  count = lists[0]->count;
+  ids = malloc(count * sizeof(unsigned int));
+  posting_decode(lists[0], ids);
+  for (t = 1; t < term_count && count; t++){
+    other_count = lists[t]->count;
+    other = malloc(other_count * sizeof(unsigned int));
+    posting_decode(lists[t], other);
+    for (i = j = n = 0; i < count && j < other_count;){
+      if (ids[i] < other[j]){
+	i++;
+      }
+      else if (ids[i] > other[j]){
+	j++;
+      }
+      else {
+	ids[n++] = ids[i++];
+	j++;
+      }
+    }
+    count = n;
+    free(other);
+  }
+  while (count && found < max){
+    matches[found++] = ids[--count];
+  }
+  free(ids);
+  return found;
+}
+
+/* Answer /search <channel> <terms>: send the newest messages of the channel
+   holding every term. Only the members of a channel search it, "global" is
+   open to the whole tenant. Runs in the thread of the client, the indexer
+   keeps going as queries only hold the read lock of the channel */
+void search_query(client *cli, char *channel_name, const char *query, size_t length){
+  search_channel *chan;
+  char terms[SEARCH_MAX_TERMS][MAX_NAME_SIZE], out[BUFFER_SIZE], date[16];
+  char *copy = strndup(query, length);
+  const char *text = copy;
+  unsigned int matches[SEARCH_RESULTS], found = 0, n, i;
+  int term_count = 0, s;
+  indexed_message *msg;
+  struct tm tm;
+  while (term_count < SEARCH_MAX_TERMS && (text = next_term(text, terms[term_count]))){
+    term_count++;
+  }
+  free(copy);
+  if (strcmp(channel_name, "global") && is_user_on_channel_named(cli, channel_name) < 0){
+    sprintf(out, "You are not on channel %s.\n", channel_name);
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    return;
+  }
+  /* Read locked before search_table_lock is released, so the index can't
+     be removed meanwhile */
+  pthread_mutex_lock(&search_table_lock);
+  if ((chan = *search_lookup(cli->tenant, channel_name))){
+    pthread_rwlock_rdlock(&chan->lock);
+  }
+  pthread_mutex_unlock(&search_table_lock);
+  if (!chan || !term_count){
+    sprintf(out, !chan ? "No message indexed on %s.\n" : "You must enter words to search.\n",
+	    channel_name);
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    if (chan){
+      pthread_rwlock_unlock(&chan->lock);
+    }
+    return;
+  }
+  for (s = chan->segment_count - 1; s >= 0 && found < SEARCH_RESULTS; s--){
+    n = segment_search(chan->segments[s], terms, term_count, matches, SEARCH_RESULTS - found);
+    for (i = 0; i < n; i++){
+      msg = chan->segments[s]->messages[matches[i]];
+      strftime(date, sizeof(date), "%H:%M:%S", localtime_r(&msg->time, &tm));
+      snprintf(out, sizeof(out), "[%s] %s: %s%s", date, msg->sender, msg->text,
+	       msg->text[0] && msg->text[strlen(msg->text) - 1] == '\n' ? "" : "\n");
+      send_message_to_client(out, cli, PRIO_CONTROL);
+    }
+    found += n;
+  }
+  pthread_rwlock_unlock(&chan->lock);
+  sprintf(out, "%u message%s found on %s.\n", found, found > 1 ? "s" : "", channel_name);
+  send_message_to_client(out, cli, PRIO_CONTROL);
+}
+
+/* Return the history of the channel name of the tenant t, NULL if there is
+   none and create is not set. The caller gets a reference to it, dropped
+   with history_release */
+history *history_find(tenant *t, char *name, int create){
+  unsigned int bucket = hash_string(name) % HISTORY_BUCKETS;
+  history *h;
+  pthread_mutex_lock(&history_table_lock);
+  for (h = history_table[bucket]; h; h = h->next){
+    if (h->tenant == t && !strcmp(h->name, name)){
+      break;
+    }
+  }
+  if (!h && create){
+    h = calloc(1, sizeof(history));
+    h->tenant = t;
+    strcpy(h->name, name);
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_mutex_init(&h->spill_lock, NULL);
+    h->ring_first = 1;
+    h->next = history_table[bucket];
+    history_table[bucket] = h;
+  }
+  if (h){
+    __atomic_add_fetch(&h->refs, 1, __ATOMIC_ACQ_REL);
+  }
+  pthread_mutex_unlock(&history_table_lock);
+  return h;
+}
+
+/* Close a part of the spill and forget its messages */
+static void history_spill_close(history_spill *part){
+  if (part->file){
+    fclose(part->file);
+  }
+  free(part->offsets);
+  memset(part, 0, sizeof(history_spill));
+}
+
+/* Oldest message of h still kept. Runs with h->lock held */
+static unsigned long history_first(history *h){
+  if (!h->spill_gap && h->spill[0].count){
+    return h->spill[0].first;
+  }
+  if (!h->spill_gap && h->spill[1].count){
+    return h->spill[1].first;
+  }
+  return h->ring_first;
+}
+
+/* Take the oldest message out of the ring. Runs with h->lock held */
+static void history_pop(history *h){
+  message_release(h->ring[h->ring_first % HISTORY_SLOTS]);
+  h->ring[h->ring_first % HISTORY_SLOTS] = NULL;
+  h->ring_first++;
+}
+
+/* Move the messages older than the last HISTORY_RING from the ring to the
+   spill. The files are written with only spill_lock held, h->lock is taken
+   to pick a message and record it. The spill is dropped when it is disabled,
+   cannot be written or a message was lost, it would have a gap otherwise */
+static void history_flush(history *h){
+  history_spill *part;
+  FILE *file = NULL;
+  unsigned long seq;
+  ssize_t written;
+  message *m;
+  pthread_mutex_lock(&h->spill_lock);
+  pthread_mutex_lock(&h->lock);
+  for (;;){
+    if (h->spill_gap){
+      history_spill_close(&h->spill[0]);
+      history_spill_close(&h->spill[1]);
+      h->spill_gap = 0;
+    }
+    if (!config_get()->history_spill || h->last - h->ring_first < HISTORY_RING){
+      break;
+    }
+    /* A full part starts the next one, the oldest part is dropped */
+    if (h->spill[1].count == HISTORY_SPILL_MAX){
+      history_spill_close(&h->spill[0]);
+      h->spill[0] = h->spill[1];
+      memset(&h->spill[1], 0, sizeof(history_spill));
+    }
+    part = &h->spill[1];
+    seq = h->ring_first;
+    m = h->ring[seq % HISTORY_SLOTS];
+    __sync_add_and_fetch(&m->refs, 1);
+    pthread_mutex_unlock(&h->lock);
+
+    if (!part->file && !(file = ops->spill_file())){
+      perror("error: unable to open a spill file");
+    }
+    written = part->file || file ?
+      pwrite(fileno(part->file ? part->file : file), m->data, m->length, part->size) : -1;
+
+    pthread_mutex_lock(&h->lock);
+    if (file){
+      part->file = file;
+      file = NULL;
+    }
+    if (written != (ssize_t)m->length){
+      if (written >= 0){
+	fprintf(stderr, "pwrite: short write\n");
+      }
+      else if (part->file){
+	perror("pwrite");
+      }
+      h->spill_gap = 1;
+    }
+    /* Unless history_publish dropped it meanwhile, as the spill lagged */
+    else if (h->ring_first == seq){
+      if (!part->count){
+	part->first = seq;
+      }
+      if (part->count == part->capacity){
+	part->capacity = part->capacity ? 2 * part->capacity : HISTORY_RING;
+	part->offsets = realloc(part->offsets, part->capacity * sizeof(off_t));
+      }
+      part->offsets[part->count++] = part->size;
+      part->size += m->length;
+      history_pop(h);
+    }
+    if (h->spill_gap && h->ring_first == seq){
+      history_pop(h);
+    }
+    message_release(m);
+  }
+  pthread_mutex_unlock(&h->lock);
+  pthread_mutex_unlock(&h->spill_lock);
+}
+
+/* Free the histories of one bucket unused for history_retention. One bucket
+   per tick, so each tick stays short and the table is swept every
+   HISTORY_BUCKETS ticks. Runs on the thread advancing the wheel */
+static void history_sweep(timer *t){
+  static unsigned int bucket;
+  unsigned long retention = SECONDS_TO_TICKS(config_get()->history_retention);
+  history **link, *h;
+  acked *a;
+  pthread_mutex_lock(&history_table_lock);
+  for (link = &history_table[bucket]; (h = *link);){
+    /* Only history_find takes a first reference, with history_table_lock */
+    if (__atomic_load_n(&h->refs, __ATOMIC_ACQUIRE) ||
+	timer_now() - __atomic_load_n(&h->released, __ATOMIC_RELAXED) < retention){
+      link = &h->next;
+      continue;
+    }
+    *link = h->next;
+    while (h->ring_first <= h->last){
+      history_pop(h);
+    }
+    history_spill_close(&h->spill[0]);
+    history_spill_close(&h->spill[1]);
+    while ((a = h->acks)){
+      h->acks = a->next;
+      free(a);
+    }
+    pthread_mutex_destroy(&h->lock);
+    pthread_mutex_destroy(&h->spill_lock);
+    free(h);
+  }
+  pthread_mutex_unlock(&history_table_lock);
+  bucket = (bucket + 1) % HISTORY_BUCKETS;
+  timer_arm(t, 1);
+}
+
+/* Say text from sender on the channel of the tenant t named chan_name:
+   stamp it with the next sequence number of the channel, keep it in the
+   history and queue it to the members. Both are done under the lock of t,
+   so every member queues the messages of a channel in sequence order. The
+   message is also submitted for /search. The messages pushed out of the
+   ring are spilled after the lock of t is released.
+   Return -1 if there is no such channel */
+int history_publish(tenant *t, char *chan_name, char *sender, const char *text, int length){
+  size_t size = length + 2 * MAX_NAME_SIZE + 40;
+  int i, flush;
+  channel *chan;
+  history *h;
+  message *m;
+  pthread_mutex_lock(&t->lock);
+  if (!(chan = find_channel_by_name(t, chan_name))){
+    pthread_mutex_unlock(&t->lock);
+    return -1;
+  }
+  /* The reference of the channel, dropped by remove_channel */
+  if (!chan->history){
+    chan->history = history_find(chan->tenant, chan->name, 1);
+  }
+  h = chan->history;
+  pthread_mutex_lock(&h->lock);
+  h->last++;
+  /* Written in place, the line can be longer than BUFFER_SIZE */
+  m = malloc(sizeof(message) + size);
+  m->length = snprintf(m->data, size, "[#%lu] %s said on %s: %.*s", h->last, sender,
+		       chan->name, length, text) + 1;
+  /* The reference of the ring */
+  m->refs = 1;
+  /* Without a spill, or when it lags a whole ring behind, the oldest
+     message is lost */
+  while (h->last - h->ring_first >= (config_get()->history_spill ? HISTORY_SLOTS : HISTORY_RING)){
+    history_pop(h);
+    h->spill_gap |= h->spill[0].count || h->spill[1].count;
+  }
+  h->ring[h->last % HISTORY_SLOTS] = m;
+  for (i = 0; i < chan->members.count; i++){
+    ops->deliver(chan->members.clients[i], m, PRIO_CHANNEL);
+  }
+  flush = h->spill_gap || h->last - h->ring_first >= HISTORY_RING;
+  pthread_mutex_unlock(&h->lock);
+  /* Queued before remove_channel can queue the removal of the index */
+  search_submit(t, chan_name, sender, text, length);
+  /* Kept until the spill is written, the channel may be removed meanwhile */
+  if (flush){
+    __atomic_add_fetch(&h->refs, 1, __ATOMIC_ACQ_REL);
+  }
+  pthread_mutex_unlock(&t->lock);
+  if (flush){
+    history_flush(h);
+    history_release(h);
+  }
+  return 0;
+}
+
+/* Answer /ack <channel> <seq>: remember that the user name of the tenant t
+   got the messages of the channel up to seq. Return -1 if the channel has
+   no history */
+int history_ack(tenant *t, char *channel_name, char *name, unsigned long seq){
+  history *h = history_find(t, channel_name, 0);
+  acked *a;
+  if (!h){
+    return -1;
+  }
+  pthread_mutex_lock(&h->lock);
+  for (a = h->acks; a && strcmp(a->name, name); a = a->next);
+  if (!a){
+    a = calloc(1, sizeof(acked));
+    strcpy(a->name, name);
+    a->next = h->acks;
+    h->acks = a;
+  }
+  if (seq > h->last){
+    seq = h->last;
+  }
+  if (seq > a->seq){
+    a->seq = seq;
+  }
+  pthread_mutex_unlock(&h->lock);
+  history_release(h);
+  return 0;
+}
+
+/* Answer /resume <channel> [seq]: send again the messages of the channel
+   after seq, after the last one acknowledged by the client when seq is
+   missing. They come from the ring, or from the spill when older */
+void history_resume(client *cli, char *channel_name, const char *from){
+  history *h = history_find(cli->tenant, channel_name, 0);
+  char out[BUFFER_SIZE];
+  unsigned long seq, first, sent = 0, lost = 0;
+  size_t length;
+  int more;
+  off_t offset;
+  history_spill *part;
+  message *m;
+  acked *a;
+  if (!h){
+    sprintf(out, "No history on %s.\n", channel_name);
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    return;
+  }
+  pthread_mutex_lock(&h->lock);
+  if (from){
+    seq = strtoul(from, NULL, 10);
+  }
+  else {
+    for (a = h->acks; a && strcmp(a->name, cli->name); a = a->next);
+    seq = a ? a->seq : 0;
+  }
+  first = history_first(h);
+  if (seq + 1 < first){
+    lost = first - seq - 1;
+    seq = first - 1;
+  }
+  for (seq++; seq <= h->last && sent < HISTORY_REPLAY; seq++, sent++){
+    if (seq >= h->ring_first){
+      ops->deliver(cli, h->ring[seq % HISTORY_SLOTS], PRIO_HISTORY);
+      continue;
+    }
+    /* Older than the ring, read it back from the spill */
+    part = &h->spill[h->spill[1].count && seq >= h->spill[1].first];
+    offset = part->offsets[seq - part->first];
+    length = (seq + 1 - part->first < part->count ?
+	      part->offsets[seq + 1 - part->first] : part->size) - offset;
+    m = malloc(sizeof(message) + length);
+    m->refs = 1;
+    m->length = length;
+    if (pread(fileno(part->file), m->data, length, offset) == (ssize_t)length){
+      ops->deliver(cli, m, PRIO_HISTORY);
+    }
+    else {
+      perror("pread");
+    }
+    message_release(m);
+  }
+  more = seq <= h->last;
+  pthread_mutex_unlock(&h->lock);
+  history_release(h);
+  length = sprintf(out, "Resumed %s: %lu message%s", channel_name, sent, sent > 1 ? "s" : "");
+  if (lost){
+    length += sprintf(out + length, ", %lu older no longer kept", lost);
+  }
+  if (more){
+    sprintf(out + length, ". Type /resume %s %lu for more.\n", channel_name, seq - 1);
+  }
+  else {
+    sprintf(out + length, ".\n");
+  }
+  send_message_to_client(out, cli, PRIO_CONTROL);
+}
+
+/* Names of the commands, by type */
+static const char *const command_names[] = {
+  [CMD_NICK] = "/nick", [CMD_ME] = "/me", [CMD_PM] = "/pm", [CMD_JOIN] = "/join",
+  [CMD_TELL] = "/tell", [CMD_LEAVE] = "/leave", [CMD_WHO] = "/who",
+  [CMD_HOWMANY] = "/howmany", [CMD_SEARCH] = "/search", [CMD_SEND] = "/send",
+  [CMD_ACK] = "/ack", [CMD_RESUME] = "/resume", [CMD_SHM] = "/shm", [CMD_ADMIN] = "/admin",
+  [CMD_PRESENCE] = "/presence", [CMD_TENANT] = "/tenant",
+  [CMD_PONG] = "/pong", [CMD_QUIT] = "/quit", [CMD_HELP] = "/help"
+};
+
+/* Return the first byte of [p, end) ending a word: a newline, or also a space
+   or a tab when blanks is set. Return end when there is none.
+   With SSE2, 16 bytes are compared at once */
+static const char *scan_delimiter(const char *p, const char *end, int blanks){
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n'), space = _mm_set1_epi8(' '),
+    tab = _mm_set1_epi8('\t');
+  __m128i chunk, found;
+  int mask;
+  while (end - p >= 16){
+    chunk = _mm_loadu_si128((const __m128i *)p);
+    found = _mm_cmpeq_epi8(chunk, newline);
+    if (blanks){
+      found = _mm_or_si128(found, _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+					       _mm_cmpeq_epi8(chunk, tab)));
+    }
+    if ((mask = _mm_movemask_epi8(found))){
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  for (; p < end; p++){
+    if (*p == '\n' || (blanks && (*p == ' ' || *p == '\t'))){
+      return p;
+    }
+  }
+  return end;
+}
+
+/* Find the type of a command from its length and its first letter,
+   one comparison then confirms it */
+static int classify_command(const char *name, size_t length){
+  int type;
+  switch (length){
+  case 3:
+    type = name[1] == 'm' ? CMD_ME : CMD_PM;
+    break;
+  case 4:
+    switch (name[1]){
+    case 'w': type = CMD_WHO; break;
+    case 'a': type = CMD_ACK; break;
+    case 's': type = CMD_SHM; break;
+    default: return CMD_UNKNOWN;
+    }
+    break;
+  case 5:
+    switch (name[1]){
+    case 'n': type = CMD_NICK; break;
+    case 'j': type = CMD_JOIN; break;
+    case 't': type = CMD_TELL; break;
+    case 's': type = CMD_SEND; break;
+    case 'p': type = CMD_PONG; break;
+    case 'q': type = CMD_QUIT; break;
+    case 'h': type = CMD_HELP; break;
+    default: return CMD_UNKNOWN;
+    }
+    break;
+  case 6:
+    type = name[1] == 'l' ? CMD_LEAVE : CMD_ADMIN;
+    break;
+  case 7:
+    switch (name[1]){
+    case 's': type = CMD_SEARCH; break;
+    case 't': type = CMD_TENANT; break;
+    case 'r': type = CMD_RESUME; break;
+    default: return CMD_UNKNOWN;
+    }
+    break;
+  case 8:
+    type = CMD_HOWMANY;
+    break;
+  case 9:
+    type = CMD_PRESENCE;
+    break;
+  default:
+    return CMD_UNKNOWN;
+  }
+  return memcmp(name, command_names[type], length) ? CMD_UNKNOWN : type;
+}
+
+/* Split the line [line, end) into its command and its words.
+   The line is left untouched, the command points into it */
+static void parse_command(const char *line, const char *end, command *cmd){
+  const char *p, *word_end;
+  int i;
+  cmd->end = end;
+  cmd->word_count = 0;
+  if (*line != '/'){
+    cmd->type = CMD_MESSAGE;
+    cmd->rest[0] = line;
+  }
+  else {
+    p = scan_delimiter(line, end, 1);
+    cmd->type = classify_command(line, p - line);
+    cmd->rest[0] = p < end ? p + 1 : end;
+    while (cmd->word_count < MAX_WORDS){
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')){
+	p++;
+      }
+      if (p == end){
+	break;
+      }
+      word_end = scan_delimiter(p, end, 1);
+      cmd->word[cmd->word_count] = p;
+      cmd->word_length[cmd->word_count] = word_end - p;
+      cmd->rest[++cmd->word_count] = word_end < end ? word_end + 1 : end;
+      p = word_end;
+    }
+  }
+  for (i = cmd->word_count + 1; i <= MAX_WORDS; i++){
+    cmd->rest[i] = end;
+  }
+}
+
+/* Copy the word i of a command into name, MAX_NAME_SIZE bytes long.
+   Return name, or NULL if the command has no such word */
+static char *word_copy(command *cmd, int i, char *name){
+  size_t length;
+  if (i >= cmd->word_count){
+    return NULL;
+  }
+  length = cmd->word_length[i] < MAX_NAME_SIZE ? cmd->word_length[i] : MAX_NAME_SIZE - 1;
+  memcpy(name, cmd->word[i], length);
+  name[length] = '\0';
+  return name;
+}
+
+/* Return the length of the rest of a command after i words,
+   0 if it holds nothing but blanks */
+static int rest_length(command *cmd, int i){
+  const char *p;
+  for (p = cmd->rest[i]; p < cmd->end; p++){
+    if (*p != ' ' && *p != '\t' && *p != '\n'){
+      return cmd->end - cmd->rest[i];
+    }
+  }
+  return 0;
+}
+
+/* Keep an entry among the STATS_TOP largest values of top, sorted by
+   decreasing value. Zero values are left out */
+static void stats_rank(stats_entry *top, int *count, tenant *t, const char *name,
+		       unsigned long value, unsigned long extra){
+  int i;
+  if (!value || (*count == STATS_TOP && top[STATS_TOP - 1].value >= value)){
+    return;
+  }
+  i = *count < STATS_TOP ? (*count)++ : STATS_TOP - 1;
+  for (; i > 0 && top[i - 1].value < value; i--){
+    top[i] = top[i - 1];
+  }
+  strcpy(top[i].tenant, t ? t->name : "-");
+  strcpy(top[i].name, name);
+  top[i].value = value;
+  top[i].extra = extra;
+}
+
+/* Take a slice of the sample of the statistics read by the admin console.
+   Each tick walks 1 / STATS_PERIOD of the shards of the clients, each under
+   its own lock, and of the channels under state_lock, so no lock is held
+   for a walk of the whole server. The last slice
+   of a period sums the counters of the commands from their shards and
+   publishes the sample. Runs on the thread advancing the wheel */
+void stats_expired(timer *t){
+  stats_sample *sample = &stats_partial;
+  unsigned long messages, sum;
+  client *cli;
+  int i, s, end;
+  end = CLIENT_SHARDS * (stats_slice + 1) / STATS_PERIOD;
+  for (s = CLIENT_SHARDS * stats_slice / STATS_PERIOD; s < end; s++){
+    pthread_mutex_lock(&client_shards[s].lock);
+    for (cli = client_shards[s].first; cli; cli = cli->shard_next){
+      messages = __atomic_load_n(&cli->messages, __ATOMIC_RELAXED);
+      stats_rank(sample->talkers, &sample->talker_count, cli->tenant, cli->name,
+		 messages - cli->messages_sampled, 0);
+      cli->messages_sampled = messages;
+      stats_rank(sample->slow, &sample->slow_count, cli->tenant, cli->name,
+		 __atomic_load_n(&cli->out.bytes, __ATOMIC_RELAXED),
+		 __atomic_load_n(&cli->out.dropped, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&client_shards[s].lock);
+  }
+  pthread_mutex_lock(&state_lock);
+  end = channel_capacity * (stats_slice + 1) / STATS_PERIOD;
+  for (i = channel_capacity * stats_slice / STATS_PERIOD; i < end; i++){
+    if (channels[i]){
+      /* Changed under the lock of its tenant, a slot is only cleared under state_lock */
+      stats_rank(sample->channels, &sample->channel_count, channels[i]->tenant, channels[i]->name,
+		 __atomic_load_n(&channels[i]->members.count, __ATOMIC_RELAXED), 0);
+    }
+  }
+  pthread_mutex_unlock(&state_lock);
+  timer_arm(t, 1);
+  if (++stats_slice < STATS_PERIOD){
+    return;
+  }
+  stats_slice = 0;
+  for (i = 0; i <= CMD_UNKNOWN; i++){
+    for (sum = 0, s = 0; s < STATS_SHARDS; s++){
+      sum += __atomic_load_n(&command_stats[s].commands[i], __ATOMIC_RELAXED);
+    }
+    sample->totals[i] = sum;
+  }
+  pthread_mutex_lock(&stats_lock);
+  for (i = 0; i <= CMD_UNKNOWN; i++){
+    sample->rates[i] = sample->totals[i] - stats.totals[i];
+  }
+  stats = *sample;
+  pthread_mutex_unlock(&stats_lock);
+  memset(sample, 0, sizeof(stats_sample));
+}
+
+/* Read an IPv4 prefix "a.b.c.d[/length]" into addr, in host order with the
+   bits after the prefix cleared. Return 0 on success, -1 if invalid */
+static int ban_parse(const char *text, uint32_t *addr, int *length){
+  char ip[INET_ADDRSTRLEN], *end;
+  const char *slash = strchr(text, '/');
+  size_t size = slash ? (size_t)(slash - text) : strlen(text);
+  struct in_addr in;
+  *length = 32;
+  if (size >= sizeof(ip)){
+    return -1;
+  }
+  memcpy(ip, text, size);
+  ip[size] = '\0';
+  if (inet_pton(AF_INET, ip, &in) != 1){
+    return -1;
+  }
+  if (slash){
+    *length = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end || *length < 0 || *length > 32){
+      return -1;
+    }
+  }
+  *addr = ntohl(in.s_addr);
+  if (*length < 32){
+    *addr &= *length ? ~0U << (32 - *length) : 0;
+  }
+  return 0;
+}
+
+/* Ban the prefix of length bits of addr, or unban it when banned is 0.
+   Return -1 when unbanning a prefix that isn't banned */
+int ban_set(uint32_t addr, int length, int banned){
+  ban_node *node = &ban_root, *next;
+  int i, bit, result = 0;
+  pthread_mutex_lock(&ban_lock);
+  for (i = 0; i < length && node; i++){
+    bit = addr >> (31 - i) & 1;
+    if (!(next = node->child[bit]) && banned){
+      next = calloc(1, sizeof(ban_node));
+      /* Published once filled, accept walks the trie without the lock */
+      __atomic_store_n(&node->child[bit], next, __ATOMIC_RELEASE);
+    }
+    node = next;
+  }
+  if (!node || (!banned && !node->banned)){
+    result = -1;
+  }
+  else {
+    __atomic_store_n(&node->banned, banned, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&ban_lock);
+  return result;
+}
+
+/* Return 1 if addr, in host order, is in a banned prefix, 0 otherwise.
+   Called for each connection accepted: 33 steps at most and no lock */
+int ban_match(uint32_t addr){
+  ban_node *node = &ban_root;
+  int i;
+  for (i = 0; node; i++){
+    if (__atomic_load_n(&node->banned, __ATOMIC_RELAXED)){
+      return 1;
+    }
+    if (i == 32){
+      break;
+    }
+    node = __atomic_load_n(&node->child[addr >> (31 - i) & 1], __ATOMIC_ACQUIRE);
+  }
+  return 0;
+}
+
+/* Write the prefixes banned under node, the one of depth bits of addr,
+   to out without going past end. Runs with ban_lock held.
+   Return the end of what was written */
+static char *ban_list(ban_node *node, uint32_t addr, int depth, char *out, char *end){
+  char ip[INET_ADDRSTRLEN];
+  struct in_addr in;
+  if (!node){
+    return out;
+  }
+  if (node->banned && end - out > INET_ADDRSTRLEN + 4){
+    in.s_addr = htonl(addr);
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+    out += sprintf(out, " %s/%d", ip, depth);
+  }
+  if (depth < 32){
+    out = ban_list(node->child[0], addr, depth + 1, out, end);
+    out = ban_list(node->child[1], addr | 1U << (31 - depth), depth + 1, out, end);
+  }
+  return out;
+}
+
+/* Make clients leave: the client of the tenant t named name, or when name
+   is NULL the clients connected from the prefix of length bits of addr but
+   the admins, so they can lift a ban on themselves. reason is queued first
+   but the connection may be shut before it is written.
+   Return the number of clients disconnected */
+int kick_clients(tenant *t, char *name, uint32_t addr, int length, char *reason){
+  uint32_t mask = length ? ~0U << (32 - length) : 0;
+  int i, count = 0;
+  client *cli;
+  if (name){
+    pthread_mutex_lock(&t->lock);
+    if ((cli = name_index_find(&t->users, name))){
+      send_message_to_client(reason, cli, PRIO_CONTROL);
+      ops->disconnect(cli);
+      count++;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return count;
+  }
+  for (i = 0; i < CLIENT_SHARDS; i++){
+    pthread_mutex_lock(&client_shards[i].lock);
+    for (cli = client_shards[i].first; cli; cli = cli->shard_next){
+      if (cli->admin || cli->addr.sin_family != AF_INET ||
+	  ((ntohl(cli->addr.sin_addr.s_addr) ^ addr) & mask)){
+	continue;
+      }
+      send_message_to_client(reason, cli, PRIO_CONTROL);
+      ops->disconnect(cli);
+      count++;
+    }
+    pthread_mutex_unlock(&client_shards[i].lock);
+  }
+  return count;
+}
+
+/* Write a view of the admin console to out */
+static void admin_view(char *out, char *title, stats_entry *entries, int count, char *unit){
+  int i;
+  out += sprintf(out, "%s:\n", title);
+  for (i = 0; i < count; i++){
+    out += sprintf(out, "  %s/%s: %lu %s", entries[i].tenant, entries[i].name,
+		   entries[i].value, unit);
+    if (entries[i].extra){
+      out += sprintf(out, " (%lu dropped)", entries[i].extra);
+    }
+    out += sprintf(out, "\n");
+  }
+  if (!count){
+    sprintf(out, "  none\n");
+  }
+}
+
+/* Compare the password given, of given_length bytes, with the one
+   configured, in a time that only depends on the length of the latter.
+   Return 1 if they match */
+static int admin_password_matches(const char *given, size_t given_length, const char *password){
+  size_t i, length = strlen(password);
+  unsigned char diff = given_length != length;
+  for (i = 0; i < length; i++){
+    diff |= password[i] ^ (i < given_length ? given[i] : 0);
+  }
+  return !diff;
+}
+
+/* Return the failed /admin logins kept for addr, admin_lock held.
+   Addresses sharing a slot share their failures */
+static admin_attempts *admin_slot(uint32_t addr){
+  return &admin_lockouts[(addr ^ addr >> 16) % ADMIN_LOCKOUT_SLOTS];
+}
+
+/* Return the seconds addr has to wait before its next /admin login, 0 if
+   it can try now */
+static unsigned long admin_wait(uint32_t addr){
+  admin_attempts *a;
+  unsigned long now = timer_now(), wait = 0;
+  pthread_mutex_lock(&admin_lock);
+  a = admin_slot(addr);
+  if (now < a->until){
+    wait = (a->until - now + SECONDS_TO_TICKS(1) - 1) / SECONDS_TO_TICKS(1);
+  }
+  pthread_mutex_unlock(&admin_lock);
+  return wait;
+}
+
+/* Record an /admin login from addr, which succeeded if ok. After a failure
+   the address waits 1 second, twice as long after each failure in a row,
+   up to ADMIN_LOCKOUT_MAX. A success, or a quiet ADMIN_LOCKOUT_MAX, clears
+   its failures */
+static void admin_record(uint32_t addr, int ok){
+  admin_attempts *a;
+  unsigned long now = timer_now();
+  pthread_mutex_lock(&admin_lock);
+  a = admin_slot(addr);
+  if (ok || a->addr != addr || now >= a->until + SECONDS_TO_TICKS(ADMIN_LOCKOUT_MAX)){
+    a->addr = addr;
+    a->failures = 0;
+    a->until = 0;
+  }
+  if (!ok){
+    a->until = now + SECONDS_TO_TICKS(a->failures < 6 ? 1 << a->failures : ADMIN_LOCKOUT_MAX);
+    a->failures++;
+  }
+  pthread_mutex_unlock(&admin_lock);
+}
+
+/* Answer /admin <password> and, once logged in, /admin <view|action>.
+   The views only read the last sample of the statistics */
+void admin_command(client *cli, config *cfg, command *cmd, char *out){
+  char action[MAX_NAME_SIZE] = "", name[MAX_NAME_SIZE] = "", word[MAX_NAME_SIZE];
+  stats_sample sample;
+  uint32_t addr;
+  int length, count, i;
+  char *p;
+  tenant *t;
+
+  if (!cfg->admin_password[0]){
+    send_message_to_client("The admin console is disabled.\n", cli, PRIO_CONTROL);
+    return;
+  }
+  if (!cli->admin){
+    /* The local clients share the address 0 */
+    addr = cli->addr.sin_family == AF_INET ? ntohl(cli->addr.sin_addr.s_addr) : 0;
+    if ((count = admin_wait(addr))){
+      sprintf(out, "Too many failed logins, try again in %d s.\n", count);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+      return;
+    }
+    i = cmd->word_count &&
+      admin_password_matches(cmd->word[0], cmd->word_length[0], cfg->admin_password);
+    admin_record(addr, i);
+    if (i){
+      cli->admin = 1;
+      printf("Client %d logged in as admin\n", cli->id);
+      send_message_to_client("You are an admin. Type /admin help for the commands.\n",
+			     cli, PRIO_CONTROL);
+    }
+    else {
+      printf("Client %d failed to log in as admin\n", cli->id);
+      send_message_to_client("Wrong password.\n", cli, PRIO_CONTROL);
+    }
+    return;
+  }
+  word_copy(cmd, 0, action);
+  word_copy(cmd, 1, name);
+  /* Names are looked up in the tenant of the admin unless one is given */
+  t = word_copy(cmd, 2, word) ? tenant_find(word) : cli->tenant;
+
+  if (!strcmp(action, "top") || !strcmp(action, "channels") || !strcmp(action, "slow") ||
+      !strcmp(action, "rates")){
+    pthread_mutex_lock(&stats_lock);
+    sample = stats;
+    pthread_mutex_unlock(&stats_lock);
+    if (action[0] == 't'){
+      admin_view(out, "Top talkers", sample.talkers, sample.talker_count, "messages/s");
+    }
+    else if (action[0] == 'c'){
+      admin_view(out, "Largest channels", sample.channels, sample.channel_count, "users");
+    }
+    else if (action[0] == 's'){
+      admin_view(out, "Slowest clients", sample.slow, sample.slow_count, "bytes queued");
+    }
+    else {
+      p = out + sprintf(out, "Commands per second (since the start):\n");
+      for (i = 0; i <= CMD_UNKNOWN; i++){
+	if (sample.totals[i]){
+	  p += sprintf(p, "  %s: %lu (%lu)\n", i == CMD_MESSAGE ? "messages" :
+		       i == CMD_UNKNOWN ? "unknown" : command_names[i],
+		       sample.rates[i], sample.totals[i]);
+	}
+      }
+    }
+  }
+  else if (!t && (!strcmp(action, "kick") || !strcmp(action, "close"))){
+    sprintf(out, "No tenant named %s.\n", word);
+  }
+  /* /admin kick <name> [tenant] */
+  else if (!strcmp(action, "kick")){
+    count = kick_clients(t, name, 0, 0, "You were kicked by an admin.\n");
+    sprintf(out, count ? "Kicked %s.\n" : "No user named %s.\n", name);
+  }
+  /* /admin close <channel> [tenant] */
+  else if (!strcmp(action, "close")){
+    sprintf(out, "Channel %s was closed by an admin.\n", name);
+    if ((count = close_channel(t, name, out)) < 0){
+      sprintf(out, "No channel named %s.\n", name);
+    }
+    else {
+      sprintf(out, "Closed %s, %d user%s removed.\n", name, count, count > 1 ? "s" : "");
+    }
+  }
+  /* /admin ban|unban <a.b.c.d[/length]> */
+  else if (!strcmp(action, "ban") || !strcmp(action, "unban")){
+    if (ban_parse(name, &addr, &length) < 0){
+      sprintf(out, "Usage: /admin %s <a.b.c.d[/length]>\n", action);
+    }
+    else if (action[0] == 'u'){
+      sprintf(out, ban_set(addr, length, 0) < 0 ? "%s isn't banned.\n" : "Unbanned %s.\n",
+	      name);
+    }
+    else {
+      ban_set(addr, length, 1);
+      count = kick_clients(NULL, NULL, addr, length, "You are banned from this server.\n");
+      sprintf(out, "Banned %s, %d client%s disconnected.\n", name, count, count > 1 ? "s" : "");
+    }
+  }
+  else if (!strcmp(action, "bans")){
+    pthread_mutex_lock(&ban_lock);
+    p = ban_list(&ban_root, 0, 0, out + sprintf(out, "Banned:"), out + BUFFER_SIZE);
+    pthread_mutex_unlock(&ban_lock);
+    sprintf(p, "\n");
+  }
+  else {
+    sprintf(out, "\n");
+    strcat(out, "/admin top\tClients sending the most messages.\n");
+    strcat(out, "/admin channels\tChannels with the most users.\n");
+    strcat(out, "/admin slow\tClients with the most bytes waiting to be sent.\n");
+    strcat(out, "/admin rates\tCommands received per second.\n");
+    strcat(out, "/admin kick <name> [tenant]\tDisconnect <name>.\n");
+    strcat(out, "/admin close <channel> [tenant]\tRemove everyone from <channel>.\n");
+    strcat(out, "/admin ban <a.b.c.d[/length]>\tRefuse the connections from a prefix, and drop its clients.\n");
+    strcat(out, "/admin unban <a.b.c.d[/length]>\tLift a ban.\n");
+    strcat(out, "/admin bans\tList the bans.\n");
+  }
+  send_message_to_client(out, cli, PRIO_CONTROL);
+}
+
+/* Run the command of a line received from cli. More of the buffer
+   received follows the line up to buffer_end, the payload of a /send
+   starts there. Return the bytes of it used, or -1 when the client leaves */
+int handle_command(client *cli, config *cfg, unsigned long now, const char *line,
+		   const char *end, const char *buffer_end, char *out){
+  command cmd;
+  int index,
+    answer,
+    length, /* length of the rest of the line */
+    offset, /* first name listed by /who */
+    limit, /* number of names listed by /who */
+    total; /* number of names on the list */
+  size_t size, /* size of a transfer */
+    pending; /* bytes of the payload already received */
+  char name[MAX_NAME_SIZE], /* first word, a name */
+    word[MAX_NAME_SIZE], /* other words */
+    *names; /* names listed by /who */
+  tenant *t;
+  tenant_quota *quota;
+
+  parse_command(line, end, &cmd);
+  word_copy(&cmd, 0, name);
+  __atomic_fetch_add(&command_stats[cli->id % STATS_SHARDS].commands[cmd.type], 1,
+		     __ATOMIC_RELAXED);
 
+  /* The first line may choose the tenant of the client, "default" otherwise */
+  if (!cli->tenant){
+    if (cmd.type != CMD_TENANT || !cmd.word_count){
+      strcpy(word, "default");
+    }
+    else {
+      strcpy(word, name);
+    }
+    if (!(t = tenant_find(word)) || tenant_enter(cli, t) < 0){
+      sprintf(out, t ? "Tenant %s is full, try again later.\n" : "No tenant named %s.\n", word);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+      return -1;
+    }
+    presence_post(t, "", PRESENCE_JOINED, cli->name);
+    if (cmd.type == CMD_TENANT){
+      sprintf(out, "Welcome to tenant %s.\n", t->name);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+      return 0;
+    }
+  }
+
+  /* A name or a text holding CONTROL_MARK could start a message looking
+     like a PING or a transfer: refuse it, but still read a /send payload */
+  if (memchr(line, CONTROL_MARK[0], end - line)){
+    if (cmd.type != CMD_SEND){
+      send_message_to_client("Control characters are not allowed.\n", cli, PRIO_CONTROL);
+      return 0;
+    }
+    name[0] = '\0';
+  }
+
+  /* Command: /send <name|channel> <size>, the payload follows the command line.
+     It is not rate limited: its payload has to be read anyway */
+  if (cmd.type == CMD_SEND){
+    if (cmd.word_count >= 2 && sscanf(word_copy(&cmd, 1, word), "%zu", &size) == 1){
+      pending = buffer_end - end;
+      if (pending > size){
+	pending = size;
+      }
+      /* A name too long matches nobody, the payload is still read */
+      if (cmd.word_length[0] >= MAX_NAME_SIZE){
+	name[0] = '\0';
+      }
+      return ops->transfer(cli, name, size, end, pending) < 0 ? -1 : (int)pending;
+    }
+    send_message_to_client("Usage: /send <name|channel> <size>\n", cli, PRIO_CONTROL);
+    return 0;
+  }
+
+  /* Enforce the message rate cap, counted over each second */
+  if (cfg->max_message_rate){
+    if (now - cli->rate_start >= SECONDS_TO_TICKS(1)){
+      cli->rate_start = now;
+      cli->rate_count = 0;
+    }
+    if (++cli->rate_count > cfg->max_message_rate){
+      /* Warn once per second, drop silently after that */
+      if (cli->rate_count == cfg->max_message_rate + 1){
+	send_message_to_client("You are sending messages too fast; message dropped.\n",
+			       cli, PRIO_CONTROL);
+      }
+      return 0;
+    }
+  }
+  /* Then the rate of its tenant, summed by the accounting timer */
+  if (__atomic_load_n(&cli->tenant->throttled, __ATOMIC_RELAXED)){
+    if (now - cli->throttle_warned >= SECONDS_TO_TICKS(1)){
+      cli->throttle_warned = now;
+      send_message_to_client("Your tenant is sending messages too fast; message dropped.\n",
+			     cli, PRIO_CONTROL);
+    }
+    return 0;
+  }
+  __atomic_fetch_add(&cli->tenant->shards[cli->id % TENANT_SHARDS].messages, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&cli->messages, cli->messages + 1, __ATOMIC_RELAXED);
+
+  if ((NAMED_COMMANDS >> cmd.type & 1) && cmd.word_count &&
+      cmd.word_length[0] > (size_t)cfg->max_name_length){
+    sprintf(out, "Names are limited to %d characters.\n", cfg->max_name_length);
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    return 0;
+  }
+
+  switch (cmd.type){
+  /* Message is not a command */
+  case CMD_MESSAGE:
+    length = end - line;
+    sprintf(out, "%s says : %.*s", cli->name, length, line);
+    send_message_to_all(cli->tenant, out);
+    search_submit(cli->tenant, "global", cli->name, line, length);
+    break;
+
+  /* Command: /nick <name> */
+  case CMD_NICK:
+    if (!cmd.word_count){
+      send_message_to_client("You must enter a name.\n", cli, PRIO_CONTROL);
+    }
+    else {
+      sprintf(out, "%s renamed to %s.\n", cli->name, name);
+      /* Renamed unless the name is already used */
+      if (rename_client(cli, name) == 0){
+	send_message_to_all(cli->tenant, out);
+      }
+      else {
+	sprintf(out, "%s is already in use.\n", name);
+	send_message_to_client(out, cli, PRIO_CONTROL);
+      }
+    }
+    break;
+
+  /* Command: /me <action> */
+  case CMD_ME:
+    if ((length = rest_length(&cmd, 0))){
+      sprintf(out, "%s %.*s", cli->name, length, cmd.rest[0]);
+      send_message_to_all(cli->tenant, out);
+    }
+    else {
+      send_message_to_client("You must enter an action.\n", cli, PRIO_CONTROL);
+    }
+    break;
+
+  /* Command: /pm <name> <private-message> */
+  case CMD_PM:
+    /* Check if name exists in the client list */
+    if (!cmd.word_count || find_client_by_name(cli->tenant, name) < 0){
+      sprintf(out, "%s is already taken.\n", cmd.word_count ? name : "(null)");
+    }
+    /* Send the private message to both sender and receiver */
+    else if ((length = rest_length(&cmd, 1))){
+      sprintf(out, "%s sends to you: %.*s", cli->name, length, cmd.rest[1]);
+      if (send_message_to_name(cli->tenant, out, name, PRIO_PRIVATE) < 0){
+	sprintf(out, "%s left the chat.\n", name);
+      }
+      else {
+	sprintf(out, "You sent to %s: %.*s", name, length, cmd.rest[1]);
+      }
+    }
+    else {
+      sprintf(out, "You must enter a message.\n");
+    }
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /join <channel-name> */
+  case CMD_JOIN:
+    if (!cmd.word_count){
+      sprintf(out, "You must enter a channel name.\n");
+    }
+    /* Add the client to the channel, creating it if it doesn't exist */
+    else if ((index = add_client_to_channel(cli, name, cfg)) == 0){
+      sprintf(out, "You are already on chan %s.\n", name);
+    }
+    else if (index > 1){
+      presence_post(cli->tenant, name, PRESENCE_JOINED, cli->name);
+      sprintf(out, "Welcome to channel %s. You are the n°%d arrived on this channel.\n", name, index);
+    }
+    else if (index == 1){
+      sprintf(out, "Welcome to channel %s. You are the n°%d arrived on this channel.\n", name, index);
+    }
+    else if (index == -2){
+      sprintf(out, "Too many users on this channel already.\n");
+    }
+    else {
+      sprintf(out, "Too many channels already.\n");
+    }
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /tell <channel-name> <message> */
+  case CMD_TELL:
+    if (!(length = rest_length(&cmd, 1))){
+      sprintf(out, "You must enter a message.\n");
+      send_message_to_client(out, cli, PRIO_CONTROL);
+    }
+    /* Send message if the given name is a channel */
+    else if (history_publish(cli->tenant, name, cli->name, cmd.rest[1], length) == 0) {
+      /* Sent, and submitted for /search, by history_publish */
+    }
+    /* Send message to server if name is global */
+    else if (!strcmp(name, "global")){
+      sprintf(out, "%s said : %.*s", cli->name, length, cmd.rest[1]);
+      send_message_to_all(cli->tenant, out);
+      search_submit(cli->tenant, name, cli->name, cmd.rest[1], length);
+    }
+    else {
+      sprintf(out, "Channel %s doesn't exist. Create it first with /join %s.\n", name, name);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+    }
+    break;
+
+  /* Command: /leave <channel-name> */
+  case CMD_LEAVE:
+    if (!cmd.word_count){
+      break;
+    }
+    /* Remove the user only if he is already on channel */
+    answer = remove_user_from_channel(cli, name);
+    if (answer == -1){
+      sprintf(out, "Chan %s doesn't exist.\n", name);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+    }
+    else if (answer >= 0) {
+      sprintf(out, "Left channel: %s. \n", name);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+      if (answer != 0){
+	presence_post(cli->tenant, name, PRESENCE_LEFT, cli->name);
+      }
+    }
+    else {
+      sprintf(out, "You are not on channel %s", name);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+    }
+    break;
+
+  /* Command: /who <channel> [offset] [limit] */
+  case CMD_WHO:
+    /* Read the optional page of names wanted */
+    offset = word_copy(&cmd, 1, word) ? atoi(word) : 0;
+    limit = word_copy(&cmd, 2, word) ? atoi(word) : cfg->who_page_size;
+    if (offset < 0){
+      offset = 0;
+    }
+    /* The page is copied under the lock of the list: keep it bounded */
+    if (limit <= 0 || limit > cfg->who_page_size){
+      limit = cfg->who_page_size;
+    }
+    names = NULL;
+    if (cmd.word_count){
+      /* If global, list the users on the server */
+      if (!strcmp(name, "global")){
+	names = who_is_on_server(cli->tenant, offset, limit, &total);
+	sprintf(out, "Users on the server");
+      }
+      /* If not and the args are a channel-name, list the users on the channel */
+      else if ((names = who_is_on_channel(cli->tenant, name, offset, limit, &total))){
+	sprintf(out, "Users on channel %s", name);
+      }
+      else {
+	sprintf(out, "No channel named %s.\n", name);
+      }
+    }
+    else {
+      sprintf(out, "You need to enter a channel name.\n");
+    }
+    /* Stream the page of names in chunks, it can be longer than out */
+    if (names){
+      if (offset > total){
+	offset = total;
+      }
+      if (limit > total - offset){
+	limit = total - offset;
+      }
+      sprintf(out + strlen(out), " (%d to %d of %d): ", limit ? offset + 1 : offset,
+	      offset + limit, total);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+      send_long_message_to_client(names, cli);
+      free(names);
+      if (offset + limit < total){
+	sprintf(out, "\nType /who %s %d for more.\n", name, offset + limit);
+      }
+      else {
+	sprintf(out, "\n");
+      }
+    }
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /howmany <channel> */
+  case CMD_HOWMANY:
+    if (!cmd.word_count){
+      sprintf(out, "You need to enter a channel name.\n");
+    }
+    /* If global, return the number of users of the tenant */
+    else if (!strcmp(name, "global")){
+      quota = tenant_limits(cfg, cli->tenant);
+      sprintf(out, "Users on the server: %d on %d users authorized.\n",
+	      cli->tenant->members.count, quota->max_clients);
+    }
+    /* If channels, return the number of channels of the tenant */
+    else if (!strcmp(name, "channels")){
+      quota = tenant_limits(cfg, cli->tenant);
+      sprintf(out, "%d channels out of %d available", cli->tenant->channels_number,
+	      quota->max_channels);
+    }
+    /* If not and the args are a channel-name, return the number of users on the channel */
+    else if ((index = channel_users(cli->tenant, name)) >= 0){
+      sprintf(out, "Users on channel %s : %d on %d users authorized.\n",
+	      name, index, cfg->max_users_by_channel);
+    }
+    else {
+      sprintf(out, "No channel named %s.\n", name);
+    }
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /search <channel> <words> */
+  case CMD_SEARCH:
+    if ((length = rest_length(&cmd, 1))){
+      search_query(cli, name, cmd.rest[1], length);
+    }
+    else {
+      send_message_to_client("You must enter a channel name and words to search.\n",
+			     cli, PRIO_CONTROL);
+    }
+    break;
+
+  /* Command: /ack <channel> <seq>, silent unless wrong */
+  case CMD_ACK:
+    if (cmd.word_count < 2 || !isdigit((unsigned char)*word_copy(&cmd, 1, word))){
+      send_message_to_client("Usage: /ack <channel> <seq>\n", cli, PRIO_CONTROL);
+    }
+    else if (history_ack(cli->tenant, name, cli->name, strtoul(word, NULL, 10)) < 0){
+      sprintf(out, "No history on %s.\n", name);
+      send_message_to_client(out, cli, PRIO_CONTROL);
+    }
+    break;
+
+  /* Command: /resume <channel> [seq] */
+  case CMD_RESUME:
+    if (cmd.word_count){
+      history_resume(cli, name, word_copy(&cmd, 1, word));
+    }
+    else {
+      send_message_to_client("Usage: /resume <channel> [seq]\n", cli, PRIO_CONTROL);
+    }
+    break;
+
+  /* Command: /shm, from a local client: its next messages come through a
+     ring in shared memory, the replies still through the socket. The answer
+     always ends with "SHM <size>", 0 when refused */
+  case CMD_SHM:
+    if (cli->addr.sin_family != AF_UNIX || !ops->upgrade || !cfg->shm_ring_size){
+      sprintf(out, "Shared memory is only offered on the Unix socket.\n");
+    }
+    else if (cli->shm){
+      sprintf(out, "You already use shared memory.\n");
+    }
+    else if (ops->upgrade(cli) < 0){
+      sprintf(out, "Unable to set up shared memory, go on with the socket.\n");
+    }
+    else {
+      break;
+    }
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    send_message_to_client(CONTROL_MARK "SHM 0\n", cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /admin <password|view|action> */
+  case CMD_ADMIN:
+    admin_command(cli, cfg, &cmd, out);
+    break;
+
+  /* Command: /presence <on|off> */
+  case CMD_PRESENCE:
+    if (cmd.word_count && (!strcmp(name, "on") || !strcmp(name, "off"))){
+      cli->presence = !strcmp(name, "on");
+      sprintf(out, "Joins and departures are now %s.\n", cli->presence ? "shown" : "hidden");
+    }
+    else {
+      sprintf(out, "Usage: /presence <on|off>\n");
+    }
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /tenant <name>, only as the first line */
+  case CMD_TENANT:
+    send_message_to_client("The tenant is chosen by the first message only.\n", cli, PRIO_CONTROL);
+    break;
+
+  /* Command: /pong, answer to a PING, receiving it was enough */
+  case CMD_PONG:
+    break;
+
+  /* Command: /quit */
+  case CMD_QUIT:
+    return -1;
+
+  /* Command: /help or not recognized command */
+  default:
+    sprintf(out, "\n");
+    if (cmd.type != CMD_HELP){
+      strcat(out, "Unrecognized command.\n");
+    }
+    strcat(out, "/nick <name>\tChange your username to <name>.\n");
+    strcat(out, "/me <action>\tSend the <action> to all.\n");
+    strcat(out, "/pm <name> <private-message>\tSend <private-message> to <name>.\n");
+    strcat(out, "/join <channel-name>\tJoin or create channel <channel-name>.\n");
+    strcat(out, "/tell <channel-name> <message>\tSend a message to a previously created channel.\n");
+    strcat(out, "/leave <channel-name>\tLeave channel <channel-name>.\n");
+    strcat(out, "/search <channel> <words>\tFind the messages of <channel>, which you are on, with all <words>. Use 'global' for server.\n");
+    strcat(out, "/send <name|channel> <size>\tSend the next <size> bytes to <name> or <channel>.\n");
+    strcat(out, "/who <channel> [offset] [limit]\tList the users on <channel>. Use 'global' for server.\n");
+    strcat(out, "/howmany <channel>\tCounts the users on <channel>. Use 'global' for server.\n");
+    strcat(out, "/ack <channel> <seq>\tAcknowledge the messages of <channel> up to [#<seq>].\n");
+    strcat(out, "/resume <channel> [seq]\tGet again the messages of <channel> after <seq>, or after your last /ack.\n");
+    strcat(out, "/presence <on|off>\tShow or hide who joins and leaves.\n");
+    strcat(out, "/shm\tOn the Unix socket, send the next messages through shared memory.\n");
+    strcat(out, "/admin <password>\tLog in to the admin console, then see /admin help.\n");
+    strcat(out, "/tenant <name>\tAs first message, enter the tenant <name> instead of default.\n");
+    strcat(out, "/quit\tQuit the client.\n");
+    strcat(out, "/help\tPrint this message.\n");
+    send_message_to_client(out, cli, PRIO_CONTROL);
+    break;
+  }
+  return 0;
+}
+
+/* Return a zeroed client placed on cpu (-1 if none), reusing one freed there.
+   Called by the thread of the client once pinned to cpu: a new client is
+   first touched, and a reused one zeroed, from that CPU and so on its node */
+client *client_alloc(int cpu){
+  client_pool *pool = &client_pools[cpu < 0 ? 0 : cpu];
+  client *cli;
+  pthread_mutex_lock(&pool->lock);
+  if ((cli = pool->free)){
+    pool->free = *(void **)cli;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (!cli){
+    cli = (client *)aligned_alloc(CACHE_LINE, sizeof(client));
+  }
+  memset(cli, 0, sizeof(client));
+  cli->cpu = cpu;
+  return cli;
+}
+
+/* Give a client back to the pool of its CPU */
+void client_free(client *cli){
+  client_pool *pool = &client_pools[cli->cpu < 0 ? 0 : cli->cpu];
+  free(cli->subs);
+  pthread_mutex_lock(&pool->lock);
+  *(void **)cli = pool->free;
+  pool->free = cli;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Greet a client that just connected */
+void client_connected(client *cli){
+  /* The others hear of it once it entered its tenant */
+  send_message_to_client("Type /help for help.\n", cli, PRIO_CONTROL);
+}
+
+/* Handle the filled bytes received from cli in buffer, capacity bytes long:
+   run every complete line, several can come at once. out is a buffer of
+   capacity + BUFFER_SIZE bytes for the replies.
+   Return the bytes used, the rest starts a line still incomplete, or -1
+   when the client quits */
+long client_input(client *cli, const char *buffer, size_t filled, size_t capacity, char *out){
+  /* Any message proves the client alive, tick 0 is kept for "never spoke" */
+  unsigned long now = timer_now();
+  config *cfg; /* taken again for each line, a reload applies from the next one */
+  const char *line, /* line being handled */
+    *end; /* end of the line, after its '\n' */
+  int used; /* bytes of the payload of a /send after its line */
+  __atomic_store_n(&cli->last_seen, now | 1, __ATOMIC_RELAXED);
+  for (line = buffer; line < buffer + filled; line = end + used){
+    end = scan_delimiter(line, buffer + filled, 0);
+    if (end < buffer + filled){
+      end++;
+    }
+    /* Wait for the rest of the line, unless it fills the whole buffer */
+    else if (line > buffer || filled < capacity){
+      break;
+    }
+    cfg = config_get();
+    if ((used = handle_command(cli, cfg, now, line, end, buffer + filled, out)) < 0){
+      return -1;
+    }
+  }
+  return line - buffer;
+}
+
+/* Remove a client that quit or was disconnected from the state of the server */
+void client_left(client *cli){
+  /* Notify the clients */
+  if (cli->tenant){
+    presence_post(cli->tenant, "", PRESENCE_LEFT, cli->name);
+  }
+  remove_user_from_all_channels(cli);
+  timer_cancel(&cli->keepalive);
+  remove_client(cli);
+}
+
+/* Take a slot for a new client, before allocating anything for it.
+   Return -1 if the server is full */
+int client_reserve(config *cfg){
+  unsigned int count = __atomic_load_n(&clients_number, __ATOMIC_RELAXED);
+  do {
+    if (count >= (unsigned int)cfg->max_clients){
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&clients_number, &count, count + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+/* Give back a slot no client was added to */
+void client_unreserve(){
+  __atomic_sub_fetch(&clients_number, 1, __ATOMIC_RELAXED);
+}
+
+/* Fill a client allocated for a slot taken with client_reserve, and add it
+   to the server: its driver has to be ready to deliver to it */
+void client_register(client *cli, int id, sockaddr_in *addr){
+  cli->addr = *addr;
+  cli->subs = calloc(channel_capacity, sizeof(subscription));
+  cli->id = id;
+  sprintf(cli->name, "%d", cli->id);
+  cli->presence = 1;
+  cli->keepalive.callback = keepalive_expired;
+  timer_arm(&cli->keepalive, SECONDS_TO_TICKS(config_get()->handshake_timeout));
+  add_client(cli);
+}
+
+/* Create the client of the connection a, on the thread of the client */
+client *client_create(arrival *a){
+  client *cli = client_alloc(a->cpu);
+  int one = 1;
+  /* The writer thread batches the queued messages itself: Nagle would only
+     hold a reply back until the client acknowledges the previous one */
+  if (a->addr.sin_family != AF_UNIX){
+    setsockopt(a->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  cli->cli_co = a->fd;
+  outqueue_start(cli);
+  client_register(cli, a->id, &a->addr);
+  printf("Client connected, using the id: %d\n", cli->id);
+  return cli;
+}
+
+/* Handle the client thread */
+void *client_loop(void *arg){
+  size_t buffer_size; /* bytes read at once */
+  char *buffer; /* bytes received, a line can span several reads */
+  /* message that will be sent, large enough for a whole message and the names around it */
+  char *out;
+  int length; /* length of the bytes read */
+  long used; /* bytes handled */
+  size_t filled = 0; /* bytes in buffer */
+  client *cli;
+  config_reader reader; /* out of the settings while waiting for the client */
+
+  /* Pin first, everything of the client is then allocated on its CPU */
+  pin_thread(pthread_self(), ((arrival *)arg)->cpu);
+  config_register(&reader);
+  config_enter();
+  cli = client_create((arrival *)arg);
+  free(arg);
+  buffer_size = config_get()->buffer_size;
+  buffer = malloc(buffer_size);
+  out = malloc(buffer_size + BUFFER_SIZE);
+  client_connected(cli);
+  config_leave();
+
+  /* Handle the reception of a message */
+  /* read is blocking ; so we enter the loop only if a message is received */
+  while ((length = client_read(cli, buffer + filled, buffer_size - filled)) > 0){
+    filled += length;
+    config_enter();
+    used = client_input(cli, buffer, filled, buffer_size, out);
+    config_leave();
+    if (used < 0){
+      break;
+    }
+    /* Keep the start of the next line */
+    filled -= used;
+    memmove(buffer, buffer + used, filled);
+  }
+
+  /* Client quit/disconnected */
+  config_enter();
+  client_left(cli);
+  config_leave();
+  config_unregister();
+
+  /* Handle the proper closing of the thread */
+  outqueue_stop(cli);
+  shm_close(cli);
+  close(cli->cli_co);
+  client_free(cli);
+  free(buffer);
+  free(out);
+  pthread_detach(pthread_self());
+  return NULL;
+}
+
+/* Refuse a connection without allocating anything for it */
+void reject_connection(int fd, char *reason){
+  send(fd, reason, strlen(reason) + 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+}
+
+/* Start the thread of the client of a new connection, which creates the
+   client on its own CPU. The connection is refused if the server is full */
+void admit_client(int fd, sockaddr_in *addr){
+  pthread_t thread; /* thread to handle client */
+  arrival *a;
+  config *cfg = config_get();
+
+  /* Take a slot before allocating anything, add_client fills it later */
+  if (client_reserve(cfg) < 0){
+    printf("Too many clients already; client rejected\n");
+    reject_connection(fd, "Too many clients, try again later.\n");
+    return;
+  }
+
+  /* Its threads share a CPU when pinning */
+  a = malloc(sizeof(arrival));
+  a->fd = fd;
+  a->addr = *addr;
+  a->id = id++;
+  a->cpu = cfg->cpu_affinity ? next_cpu++ % cpu_count : -1;
+  if (pthread_create(&thread, &thread_attr, client_loop, (void *)a)){
+    perror("error: unable to create the client thread");
+    client_unreserve();
+    close(fd);
+    free(a);
+  }
+}
+
+/* Open the fd kept aside for when the process runs out of fds */
+void open_reserve_fd(){
+  if ((reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0){
+    perror("error: unable to open the reserve fd");
+  }
+}
+
+/* Accept the pending connections of the listening socket listener,
+   accept_batch at most per call.
+   Errors never stop the server: when out of fds, the reserve fd is
+   released to accept and close the next connection, so it leaves the
+   backlog instead of waking poll up again and again. With no reserve fd
+   and none to open, the listeners are left alone for ACCEPT_BACKOFF */
+void accept_clients(int listener, unsigned long now){
+  int i, fd;
+  socklen_t address_length; /* client address length */
+  sockaddr_in cli_addr; /* client address */
+  int batch = config_get()->accept_batch;
+
+  for (i = 0; i < batch; i++){
+    address_length = sizeof(cli_addr);
+    /* cli_addr given by accept with connect informations */
+    if ((fd = accept4(listener, (sockaddr*)(&cli_addr), &address_length,
+		      SOCK_CLOEXEC)) >= 0){
+      /* Local clients are told apart by the family of their address */
+      if (listener == unix_descriptor){
+	memset(&cli_addr, 0, sizeof(cli_addr));
+	cli_addr.sin_family = AF_UNIX;
+      }
+      else if (ban_match(ntohl(cli_addr.sin_addr.s_addr))){
+	reject_connection(fd, "You are banned from this server.\n");
+	continue;
+      }
+      admit_client(fd, &cli_addr);
+      continue;
+    }
+    switch (errno){
+    case EAGAIN:
+      return;
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+      continue;
+    case EMFILE:
+    case ENFILE:
+      if (reserve_fd < 0){
+	open_reserve_fd();
+      }
+      if (reserve_fd < 0){
+	accept_paused_until = now + SECONDS_TO_TICKS(ACCEPT_BACKOFF);
+	return;
+      }
+      close(reserve_fd);
+      if ((fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) >= 0){
+	printf("Out of file descriptors; client rejected\n");
+	reject_connection(fd, "Server busy, try again later.\n");
+      }
+      open_reserve_fd();
+      continue;
+    default:
+      perror("error: unable to accept connection to the client.");
+      return;
+    }
+  }
+}
+
+/* Wake the thread of a client up, it cleans up as if the client quit */
+static void socket_disconnect(client *cli){
+  shutdown(cli->cli_co, SHUT_RDWR);
+}
+
+/* Return the date of the system */
+static time_t socket_wall_time(){
+  return time(NULL);
+}
+
+/* Run the core on sockets: writer threads, splice and the system clock */
+static const server_ops socket_ops = {
+  outqueue_push,
+  relay_transfer,
+  socket_disconnect,
+  socket_wall_time,
+  shm_upgrade,
+  outqueue_charge,
+  tmpfile
+};
+
+/* Set up the state of the core with the settings read at startup: the
+   arrays, the pools and the timers of the server. Called once, by main or
+   by another driver once it installed its ops */
+void core_start(config *cfg){
+  int i;
+
+  /* The arrays are sized once, reloads can only lower the limits */
+  client_capacity = cfg->max_clients;
+  channel_capacity = cfg->max_channels;
+  user_capacity = cfg->max_users_by_channel;
+  channels = calloc(channel_capacity, sizeof(channel *));
+  pthread_attr_init(&thread_attr);
+  if (cfg->thread_stack_size && pthread_attr_setstacksize(&thread_attr, cfg->thread_stack_size)) {
+    fprintf(stderr, "error: invalid thread_stack_size, using the default one\n");
+  }
+
+  /* One pool of clients and one of channels per CPU */
+  if ((cpu_count = sysconf(_SC_NPROCESSORS_ONLN)) < 1){
+    cpu_count = 1;
+  }
+  client_pools = (client_pool *)aligned_alloc(CACHE_LINE, cpu_count * sizeof(client_pool));
+  channel_pools = calloc(cpu_count, sizeof(channel *));
+  for (i = 0; i < CLIENT_SHARDS; i++){
+    pthread_mutex_init(&client_shards[i].lock, NULL);
+  }
+  /* Taken from the end, channel 0 first */
+  free_channel_ids = malloc(channel_capacity * sizeof(int));
+  for (i = 0; i < channel_capacity; i++){
+    free_channel_ids[i] = channel_capacity - 1 - i;
+  }
+  for (i = 0; i < cpu_count; i++){
+    pthread_mutex_init(&client_pools[i].lock, NULL);
+    client_pools[i].free = NULL;
+  }
+
+  presence_timer.callback = presence_expired;
+  tenant_timer.callback = tenant_account;
+  timer_arm(&tenant_timer, 1);
+  stats_timer.callback = stats_expired;
+  timer_arm(&stats_timer, 1);
+  history_timer.callback = history_sweep;
+  timer_arm(&history_timer, 1);
+}
+
+/*--------- Main ---------*/
+
+int main(int argc, char **argv) {
+  sockaddr_in local_address;    /* local address socket informations */
+  struct sockaddr_un unix_address; /* path of the Unix socket */
+  struct pollfd listeners[2]; /* listening sockets waited on by poll, TCP then Unix */
+  int listener_count = 1; /* 2 when the Unix socket is used */
+  int enable = 1; /* value of the socket options enabled */
+  int i;
+  config *cfg; /* settings read at startup */
+  pthread_t indexer; /* thread indexing the messages */
+  unsigned long now; /* current tick */
+
+  if (argc > 2) {
+    fprintf(stderr, "usage : server [configuration-file]\n");
+    exit(1);
+  }
+  config_path = argc == 2 ? argv[1] : NULL;
+  ops = &socket_ops;
+  if (config_load(config_path) < 0) {
+    exit(1);
+  }
+  cfg = config_get();
+  core_start(cfg);
+
+  /* The main thread accepting the connections and running the timers
+     takes the first CPU, the clients all of them in turn */
+  if (cfg->cpu_affinity){
+    pin_thread(pthread_self(), 0);
+  }
+
+  /* Ignore SIGPIPE: writes to a closed connection fail with EPIPE instead */
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, signal_handler);
+  signal(SIGHUP, signal_handler);
+
+  memset(&local_address, 0, sizeof(local_address));
+  local_address.sin_family = AF_INET;
+  if (inet_pton(AF_INET, cfg->bind_address, &local_address.sin_addr) != 1) {
+    fprintf(stderr, "error: invalid bind_address %s\n", cfg->bind_address);
+    exit(1);
+  }
+  /* use the configured port */
+  local_address.sin_port = htons(cfg->port);
+  printf("Using port : %d \n", ntohs(local_address.sin_port));
+  /* create socket in socket_descriptor */
+  /* non blocking, so a batch of accepts stops when the backlog is empty */
+  if ((socket_descriptor = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    perror("error: unable to create the connection socket.");
+    exit(1);
+  }
+  setsockopt(socket_descriptor, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  /* bind socket socket_descriptor to sockaddr_in local_address */
+  if ((bind(socket_descriptor, (sockaddr*)(&local_address), sizeof(local_address))) < 0) {
+    perror("error: unable to bind the socket to the connection address.");
+    exit(1);
+  }
+  /* initialize the queue, large enough to absorb connection storms */
+  if (listen(socket_descriptor, cfg->backlog) < 0) {
+    perror("error: unable to listen on the socket.");
+    exit(1);
+  }
+  /* The local clients can also connect through a Unix socket */
+  if (cfg->unix_path[0]) {
+    memset(&unix_address, 0, sizeof(unix_address));
+    unix_address.sun_family = AF_UNIX;
+    strcpy(unix_address.sun_path, cfg->unix_path);
+    unlink(cfg->unix_path);
+    if ((unix_descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+	bind(unix_descriptor, (sockaddr*)(&unix_address), sizeof(unix_address)) < 0 ||
+	listen(unix_descriptor, cfg->backlog) < 0) {
+      perror("error: unable to listen on the Unix socket.");
+      exit(1);
+    }
+    printf("Using Unix socket : %s \n", cfg->unix_path);
+    listener_count = 2;
+  }
+  open_reserve_fd();
+
+  /* Start the thread indexing the messages for /search */
+  if (pthread_create(&indexer, NULL, search_loop, NULL)) {
+    perror("error: unable to create the indexer thread.");
+    exit(1);
+  }
+  /* Named, so its CPU time can be told apart, e.g. by bench/search_cost */
+  pthread_setname_np(indexer, "indexer");
+
+  listeners[0].fd = socket_descriptor;
+  listeners[1].fd = unix_descriptor;
+  now = clock_ticks();
+
+  for(;;) {
+    /* Wake up at least every tick to advance the timers */
+    listeners[0].events = listeners[1].events = now < accept_paused_until ? 0 : POLLIN;
+    if (poll(listeners, listener_count, TIMER_TICK) < 0){
+      listeners[0].revents = listeners[1].revents = 0;
+    }
+    timer_advance(now = clock_ticks());
+    config_reclaim();
+    if (reload_requested){
+      reload_requested = 0;
+      if (config_load(config_path) == 0){
+	printf("Configuration reloaded\n");
+      }
+    }
+    for (i = 0; i < listener_count; i++){
+      if (listeners[i].revents & POLLIN){
+	accept_clients(listeners[i].fd, now);
+      }
+    }
   }
 
 
@@ -0,0 +1,571 @@
+/* Deterministic simulation of the core of the server: no socket, no thread
+   but this one, and a virtual clock. The server is compiled in with its
+   own ops replaced: the messages are delivered into memory, the timer
+   wheel only moves when the simulation advances its clock, and the
+   indexer runs with search_step at chosen points.
+   Every step, a generator seeded from the command line picks what happens
+   next: a client connects or drops, a client writes a command, part of
+   what a client wrote reaches the server, or time passes. The same seed
+   gives the same run, down to the bytes each client received, summed up
+   by the trace printed at the end. The state of the server is checked
+   every CHECK_PERIOD steps and once everyone left.
+
+   usage: sim [-v] [seed] [steps] [clients]
+   -v prints every event on stderr, to replay a failing seed */
+
+#define main server_main
+#include "../server.c"
+#undef main
+#include <sys/mman.h>
+
+#define SIM_STEPS 100000          /* Steps of a run by default */
+#define SIM_CLIENTS 2000          /* Clients connected at most by default */
+#define SIM_CHANNELS 16           /* Channel names used, c0 to c15 */
+#define SIM_INPUT 4096            /* Bytes a client can have written and not yet sent */
+#define SIM_EPOCH 1700000000      /* Wall time of tick 0 */
+#define CHECK_PERIOD 1000
+
+/* Client of the simulation, and what it has seen of the server */
+typedef struct {
+  client *cli;                   /* Client in the server, NULL once gone */
+  int index;                     /* Index in sims */
+  int gone;                      /* Set when the server asked to disconnect it */
+  int pinged;                    /* Set when a PING waits for its answer */
+  char input[SIM_INPUT];         /* Bytes written, not yet read by the server */
+  size_t input_length;
+  char *buffer;                  /* Bytes read by the server, as in client_loop */
+  size_t filled;
+  size_t swallow;                /* Bytes of a /send payload still to relay */
+  int *relay;                    /* Ids of the recipients of that payload */
+  int relay_count;
+  size_t relay_size;
+  char relay_target[MAX_NAME_SIZE];
+  unsigned long seq[SIM_CHANNELS]; /* Last [#seq] received on each channel, 0 if none since joining */
+  unsigned long received;        /* Messages received */
+} sim_client;
+
+static unsigned long rng;        /* State of the generator */
+static int verbose;
+static long step;
+static unsigned long seed;
+static unsigned long now;        /* Virtual clock, in ticks */
+static unsigned long trace = 14695981039346656037UL; /* FNV-1a of everything received */
+static sim_client **sims;        /* Clients of the simulation, by index */
+static int sim_count;            /* Clients in sims, connected or not */
+static sim_client **by_id;       /* The same, by id in the server */
+static int id_capacity;
+static int next_id = 1;
+static int live, peak;           /* Clients connected, now and at most */
+static long connects, refusals, lines, deliveries, drops;
+static size_t buffer_size;
+static char *out;                /* Replies of client_input */
+static FILE *report;             /* Standard output, the server writes to /dev/null */
+
+/* xorshift64*: the only source of choices */
+static unsigned long sim_random(){
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717UL;
+}
+
+static int sim_below(int n){
+  return (int)(sim_random() % (unsigned long)n);
+}
+
+static void sim_fail(const char *what){
+  fprintf(report, "sim: seed %lu, step %ld: %s\n", seed, step, what);
+  exit(1);
+}
+
+static void sim_trace(const void *data, size_t length){
+  const unsigned char *p = data;
+  while (length--){
+    trace = (trace ^ *p++) * 1099511628211UL;
+  }
+}
+
+/* Record a message received by sc and check the order of the channels */
+static void sim_receive(sim_client *sc, const char *data, size_t length, int prio){
+  char name[MAX_NAME_SIZE];
+  unsigned long seq;
+  int c;
+  sim_trace(&sc->index, sizeof(sc->index));
+  sim_trace(data, length);
+  sc->received++;
+  deliveries++;
+  if (!strncmp(data, CONTROL_MARK "PING", 5)){
+    sc->pinged = 1;
+  }
+  else if ((sscanf(data, "Welcome to channel c%d.", &c) == 1 ||
+	    sscanf(data, "Left channel: c%d.", &c) == 1 ||
+	    sscanf(data, "Channel c%d was closed", &c) == 1) && c >= 0 && c < SIM_CHANNELS){
+    sc->seq[c] = 0;
+  }
+  /* A member gets every message of a channel, in order */
+  else if (prio == PRIO_CHANNEL && sscanf(data, "[#%lu] %*s said on c%d:", &seq, &c) == 2 &&
+	   c >= 0 && c < SIM_CHANNELS){
+    if (sc->seq[c] && seq != sc->seq[c] + 1){
+      snprintf(name, sizeof(name), "c%d", c);
+      fprintf(report, "sim: client %d got [#%lu] on %s after [#%lu]\n",
+	      sc->index, seq, name, sc->seq[c]);
+      sim_fail("messages of a channel out of order");
+    }
+    sc->seq[c] = seq;
+  }
+}
+
+static sim_client *sim_of(client *cli){
+  if (cli->id <= 0 || cli->id >= id_capacity || !by_id[cli->id]){
+    sim_fail("delivery to a client the simulation doesn't know");
+  }
+  return by_id[cli->id];
+}
+
+static int sim_deliver(client *cli, message *m, int prio){
+  sim_receive(sim_of(cli), m->data, m->length - 1, prio);
+  return 0;
+}
+
+/* Called with locks held: the client leaves after the step */
+static void sim_disconnect(client *cli){
+  sim_of(cli)->gone = 1;
+}
+
+static time_t sim_wall_time(){
+  return SIM_EPOCH + now * TIMER_TICK / 1000;
+}
+
+/* The spilled history stays in memory */
+static FILE *sim_spill_file(){
+  int fd = memfd_create("spill", MFD_CLOEXEC);
+  return fd < 0 ? NULL : fdopen(fd, "w+");
+}
+
+/* The queues are in memory and never full: nothing to charge */
+static void sim_charge(client *cli, tenant *t){
+  (void)cli;
+  (void)t;
+}
+
+/* Relay the payload bytes already read, the rest is relayed as the
+   sender writes it, by sim_feed */
+static int sim_transfer(client *cli, char *target, size_t size,
+			const char *pending, size_t pending_length){
+  sim_client *sc = sim_of(cli);
+  transfer_target *targets = calloc(user_capacity, sizeof(transfer_target));
+  char line[BUFFER_SIZE];
+  int i;
+  pthread_mutex_lock(&cli->tenant->lock);
+  sc->relay_count = transfer_targets(cli, target, size, targets, line);
+  pthread_mutex_unlock(&cli->tenant->lock);
+  sc->relay = realloc(sc->relay, (sc->relay_count + 1) * sizeof(int));
+  for (i = 0; i < sc->relay_count; i++){
+    sc->relay[i] = targets[i].cli->id;
+    send_message_to_client(line, targets[i].cli, PRIO_PRIVATE);
+    sim_receive(by_id[sc->relay[i]], pending, pending_length, PRIO_PRIVATE);
+  }
+  free(targets);
+  strcpy(sc->relay_target, target);
+  sc->relay_size = size;
+  sc->swallow = size - pending_length;
+  return 0;
+}
+
+/* Tell the recipients still there that the /send of sc is over */
+static void sim_relay_end(sim_client *sc, int lost){
+  sim_client *target;
+  char line[BUFFER_SIZE];
+  int i;
+  sprintf(line, lost ? "\nTransfer from %s interrupted.\n" : "\nEnd of transfer from %s.\n",
+	  sc->cli->name);
+  for (i = 0; i < sc->relay_count; i++){
+    if ((target = by_id[sc->relay[i]])->cli){
+      send_message_to_client(line, target->cli, PRIO_PRIVATE);
+    }
+  }
+  if (!lost){
+    transfer_report(sc->cli, sc->relay_target, sc->relay_size, sc->relay_count);
+  }
+}
+
+/* Relay length bytes of the payload of a /send of sc, and end it once all came */
+static void sim_relay(sim_client *sc, const char *data, size_t length){
+  sim_client *target;
+  int i;
+  sc->swallow -= length;
+  for (i = 0; i < sc->relay_count; i++){
+    if ((target = by_id[sc->relay[i]])->cli){
+      sim_receive(target, data, length, PRIO_PRIVATE);
+    }
+  }
+  if (!sc->swallow){
+    sim_relay_end(sc, 0);
+  }
+}
+
+static const server_ops sim_ops = {
+  sim_deliver,
+  sim_transfer,
+  sim_disconnect,
+  sim_wall_time,
+  NULL,
+  sim_charge,
+  sim_spill_file
+};
+
+/* Remove a client that quit, dropped or was disconnected, as client_loop does */
+static void sim_leave(sim_client *sc){
+  if (sc->swallow){
+    sim_relay_end(sc, 1);
+  }
+  client_left(sc->cli);
+  client_free(sc->cli);
+  sc->cli = NULL;
+  live--;
+  sc->gone = 0;
+  sc->input_length = sc->filled = sc->swallow = 0;
+}
+
+static sim_client *sim_pick(){
+  sim_client *sc;
+  int tries;
+  for (tries = 0; tries < 8 && sim_count; tries++){
+    if ((sc = sims[sim_below(sim_count)])->cli){
+      return sc;
+    }
+  }
+  return NULL;
+}
+
+/* Make sc write a line, or a /send with its payload */
+static void sim_write(sim_client *sc){
+  char line[SIM_INPUT];
+  int length, c = sim_below(SIM_CHANNELS), other = sim_below(sim_count), size, i;
+  if (sc->pinged && sim_below(4)){
+    sc->pinged = 0;
+    length = sprintf(line, "/pong\n");
+  }
+  else switch (sim_below(20)){
+  case 0: length = sprintf(line, "/nick u%d\n", sim_below(2 * sim_count)); break;
+  case 1: case 2: length = sprintf(line, "/join c%d\n", c); break;
+  case 3: length = sprintf(line, "/leave c%d\n", c); break;
+  case 4: case 5: case 6: case 7:
+    length = sprintf(line, "/tell c%d w%d w%d w%d\n", c, sim_below(50), sim_below(50), sim_below(50));
+    break;
+  case 8: length = sprintf(line, "hello w%d\n", sim_below(50)); break;
+  case 9: length = sprintf(line, "/pm u%d w%d\n", other, sim_below(50)); break;
+  case 10: length = sprintf(line, "/who c%d %d %d\n", c, sim_below(4), 1 + sim_below(20)); break;
+  case 11: length = sprintf(line, "/howmany %s\n", sim_below(2) ? "global" : "c1"); break;
+  case 12: length = sprintf(line, "/search c%d w%d\n", c, sim_below(50)); break;
+  case 13: length = sprintf(line, "/resume c%d %d\n", c, sim_below(100)); break;
+  case 14: length = sprintf(line, "/ack c%d %d\n", c, sim_below(100)); break;
+  case 15: length = sprintf(line, "/me w%d\n", sim_below(50)); break;
+  case 16: length = sprintf(line, "/presence %s\n", sim_below(2) ? "on" : "off"); break;
+  case 17:
+    size = 1 + sim_below(600);
+    length = sprintf(line, "/send %s%d %d\n", sim_below(2) ? "u" : "c", sim_below(2) ? other : c, size);
+    for (i = 0; i < size; i++){
+      line[length++] = 'a' + sim_below(26);
+    }
+    break;
+  case 18:
+    /* An admin closing a channel or kicking someone */
+    length = sim_below(2) ? sprintf(line, "/admin sim\n/admin close c%d\n", c) :
+      sprintf(line, "/admin sim\n/admin kick u%d\n", other);
+    break;
+  default:
+    /* Noise: unknown commands, control bytes, a rare /quit */
+    length = sim_below(8) ? sprintf(line, "/%c%c\n", 'a' + sim_below(26), 1 + sim_below(40)) :
+      sprintf(line, "/quit\n");
+  }
+  if (sc->input_length + length > SIM_INPUT){
+    return;
+  }
+  if (verbose){
+    fprintf(stderr, "%ld: %d writes %.*s", step, sc->index, length < 80 ? length : 80, line);
+  }
+  memcpy(sc->input + sc->input_length, line, length);
+  sc->input_length += length;
+  lines++;
+}
+
+/* Make a random part of what sc wrote reach the server */
+static void sim_feed(sim_client *sc){
+  size_t n = 1 + sim_below(sc->input_length), relayed;
+  char *data = sc->input;
+  long used;
+  if (verbose){
+    fprintf(stderr, "%ld: %d sends %zu bytes\n", step, sc->index, n);
+  }
+  /* The rest of a /send payload is relayed before any command */
+  if (sc->swallow){
+    relayed = n < sc->swallow ? n : sc->swallow;
+    sim_relay(sc, data, relayed);
+    data += relayed;
+    n -= relayed;
+    sc->input_length -= relayed;
+  }
+  if (n > buffer_size - sc->filled){
+    n = buffer_size - sc->filled;
+  }
+  memcpy(sc->buffer + sc->filled, data, n);
+  sc->filled += n;
+  sc->input_length -= n;
+  memmove(sc->input, data + n, sc->input_length);
+  if ((used = client_input(sc->cli, sc->buffer, sc->filled, buffer_size, out)) < 0){
+    sim_leave(sc);
+    return;
+  }
+  sc->filled -= used;
+  memmove(sc->buffer, sc->buffer + used, sc->filled);
+}
+
+/* Connect a new client, unless the server is full. It says who it is at once */
+static void sim_connect(){
+  sockaddr_in addr;
+  sim_client *sc;
+  if (client_reserve(config_get()) < 0){
+    refusals++;
+    return;
+  }
+  connects++;
+  sc = calloc(1, sizeof(sim_client));
+  sc->index = sim_count;
+  sc->buffer = malloc(buffer_size);
+  sims = realloc(sims, (sim_count + 1) * sizeof(sim_client *));
+  sims[sim_count++] = sc;
+  if (next_id >= id_capacity){
+    id_capacity = id_capacity ? 2 * id_capacity : 1024;
+    by_id = realloc(by_id, id_capacity * sizeof(sim_client *));
+  }
+  by_id[next_id] = sc;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(0x0a000000 | sc->index);
+  sc->cli = client_alloc(-1);
+  client_register(sc->cli, next_id++, &addr);
+  client_connected(sc->cli);
+  if (++live > peak){
+    peak = live;
+  }
+  sc->input_length = sim_below(4) ? sprintf(sc->input, "/nick u%d\n", sc->index) :
+    sprintf(sc->input, "/tenant blue\n/nick u%d\n", sc->index);
+  sim_feed(sc);
+}
+
+/* Check the clients and the channels of the server against each other,
+   and against the clients of the simulation */
+static void sim_check(){
+  int i, j, live = 0, listed = 0, entered = 0, in_tenants = 0;
+  channel *chan;
+  client *cli;
+  subscription *sub;
+  member_list *members;
+  tenant *t;
+  for (i = 0; i < sim_count; i++){
+    live += sims[i]->cli != NULL;
+    entered += sims[i]->cli && sims[i]->cli->tenant;
+  }
+  for (i = 0; i < CLIENT_SHARDS; i++){
+    pthread_mutex_lock(&client_shards[i].lock);
+    for (cli = client_shards[i].first; cli; cli = cli->shard_next){
+      listed++;
+      if (cli->id % CLIENT_SHARDS != i || *cli->shard_prev != cli){
+	sim_fail("a client is linked in another shard");
+      }
+      if (cli->id >= id_capacity || by_id[cli->id]->cli != cli){
+	sim_fail("a client of the server isn't connected");
+      }
+      for (j = 0; j < channel_capacity; j++){
+	if (!(chan = (sub = &cli->subs[j])->chan)){
+	  continue;
+	}
+	if (channels[j] != chan){
+	  sim_fail("a client is on a removed channel");
+	}
+	if (sub->slot >= chan->members.count || chan->members.clients[sub->slot] != cli){
+	  sim_fail("a client lists a channel it isn't a member of");
+	}
+      }
+    }
+    pthread_mutex_unlock(&client_shards[i].lock);
+  }
+  if (listed != live || (int)clients_number != live){
+    sim_fail("the server counts another number of clients");
+  }
+  pthread_mutex_lock(&state_lock);
+  for (i = 0; i < channel_capacity; i++){
+    if (!(chan = channels[i])){
+      continue;
+    }
+    members = &chan->members;
+    if (!members->count){
+      sim_fail("an empty channel is left");
+    }
+    for (j = 0; j < members->count; j++){
+      sub = &members->clients[j]->subs[i];
+      if (sub->chan != chan || sub->slot != j){
+	sim_fail("a member doesn't list its channel");
+      }
+      if (strcmp(members->names[j], members->clients[j]->name)){
+	sim_fail("a member is listed under another name");
+      }
+    }
+    if (name_index_find(&chan->tenant->channels, chan->name) != chan){
+      sim_fail("a channel isn't found by its name");
+    }
+  }
+  pthread_mutex_unlock(&state_lock);
+  for (t = tenants; t; t = t->next){
+    pthread_mutex_lock(&t->lock);
+    members = &t->members;
+    for (j = 0; j < members->count; j++){
+      if (members->clients[j]->tenant != t || members->clients[j]->tenant_slot != j ||
+	  strcmp(members->names[j], members->clients[j]->name)){
+	sim_fail("a user is listed in its tenant at another place or name");
+      }
+      if (!(cli = name_index_find(&t->users, members->clients[j]->name)) ||
+	  strcmp(cli->name, members->clients[j]->name)){
+	sim_fail("a user isn't found by its name");
+      }
+    }
+    if ((int)t->users.count != members->count || (int)t->channels.count != t->channels_number){
+      sim_fail("a tenant indexes another number of users or channels");
+    }
+    in_tenants += members->count;
+    pthread_mutex_unlock(&t->lock);
+  }
+  if (in_tenants != entered){
+    sim_fail("the tenants count another number of clients");
+  }
+}
+
+/* Let ticks pass: the timers run, then the clients they dropped leave */
+static void sim_advance(unsigned long ticks){
+  int i;
+  now += ticks;
+  if (verbose){
+    fprintf(stderr, "%ld: tick %lu\n", step, now);
+  }
+  timer_advance(now);
+  config_reclaim();
+  for (i = 0; i < sim_count; i++){
+    if (sims[i]->gone){
+      sim_leave(sims[i]);
+    }
+  }
+}
+
+int main(int argc, char **argv){
+  char conf_path[] = "/tmp/chat-sim-XXXXXX";
+  long steps = SIM_STEPS;
+  int max_clients = SIM_CLIENTS, fd, i;
+  sim_client *sc;
+  FILE *conf;
+
+  if (argc > 1 && !strcmp(argv[1], "-v")){
+    verbose = 1;
+    argv++;
+    argc--;
+  }
+  seed = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+  steps = argc > 2 ? atol(argv[2]) : steps;
+  max_clients = argc > 3 ? atoi(argv[3]) : max_clients;
+  rng = seed * 0x9e3779b97f4a7c15UL + 1;
+
+  if ((fd = mkstemp(conf_path)) < 0 || !(conf = fdopen(fd, "w"))){
+    perror(conf_path);
+    exit(1);
+  }
+  fprintf(conf,
+	  "max_clients %d\n"
+	  "max_channels %d\n"
+	  "max_users_by_channel %d\n"
+	  "max_message_rate 20\n"
+	  "handshake_timeout 5\n"
+	  "idle_timeout 30\n"
+	  "pong_timeout 10\n"
+	  "history_retention 60\n"
+	  "search_memory 4194304\n"
+	  "admin_password sim\n"
+	  "tenant blue %d 8 0 0\n", max_clients, 4 * SIM_CHANNELS, max_clients, max_clients / 4);
+  fclose(conf);
+  report = fdopen(dup(1), "w");
+  if (!freopen("/dev/null", "w", stdout)){
+    perror("/dev/null");
+    exit(1);
+  }
+  ops = &sim_ops;
+  if (config_load(conf_path) < 0){
+    exit(1);
+  }
+  unlink(conf_path);
+  core_start(config_get());
+  buffer_size = config_get()->buffer_size;
+  out = malloc(buffer_size + BUFFER_SIZE);
+
+  for (step = 0; step < steps; step++){
+    i = sim_below(100);
+    /* Some more clients than the server takes try to connect */
+    if (i < 5){
+      if (live < max_clients + max_clients / 8){
+	sim_connect();
+      }
+    }
+    else if (i < 6){
+      /* The connection drops, whatever it was doing */
+      if ((sc = sim_pick())){
+	if (verbose){
+	  fprintf(stderr, "%ld: %d drops\n", step, sc->index);
+	}
+	drops++;
+	sim_leave(sc);
+      }
+    }
+    else if (i < 50){
+      if ((sc = sim_pick())){
+	sim_write(sc);
+      }
+    }
+    else if (i < 95){
+      if ((sc = sim_pick()) && sc->input_length){
+	sim_feed(sc);
+      }
+    }
+    /* Mostly a tick, sometimes long enough for the idle clients to be pinged */
+    else if (i < 96){
+      sim_advance(sim_below(100) ? 1 : 20 * SECONDS_TO_TICKS(1));
+    }
+    /* The indexer lags behind, by a chosen amount */
+    if (sim_below(4) == 0){
+      while (search_step(0));
+    }
+    for (i = 0; i < sim_count; i++){
+      if (sims[i]->gone){
+	sim_leave(sims[i]);
+      }
+    }
+    if (step % CHECK_PERIOD == 0){
+      sim_check();
+    }
+  }
+
+  /* Everyone leaves: nothing may be left behind */
+  for (i = 0; i < sim_count; i++){
+    if (sims[i]->cli){
+      sim_leave(sims[i]);
+    }
+  }
+  sim_advance(SECONDS_TO_TICKS(config_get()->history_retention) + 10 * SECONDS_TO_TICKS(1));
+  while (search_step(0));
+  sim_check();
+  if (clients_number || channels_number){
+    sim_fail("clients or channels left once everyone left");
+  }
+
+  fprintf(report, "sim: seed %lu, %ld steps, %lu s, %ld connects, %d at most, %ld refused, "
+	  "%ld drops, %ld lines, %ld messages received, trace %016lx\n", seed, steps,
+	  now * TIMER_TICK / 1000, connects, peak, refusals, drops, lines, deliveries, trace);
+  return 0;
+}